@@ -4,6 +4,8 @@
   #include <pthread.h>
 #endif
 #include <git2.h>
+#include <git2/sys/commit_graph.h>
+#include <git2/sys/stream.h>
 #include <mbedtls/sha256.h>
 #include <mbedtls/x509.h>
 #include <mbedtls/entropy.h>
@@ -17,6 +19,17 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#if _WIN32
+  #include <direct.h>
+#else
+  #include <unistd.h>
+  #include <fcntl.h>
+  #include <sys/mman.h>
+#endif
 #if LIBGIT2_STANDLONE
   #include <lua.h>
   #include <lauxlib.h>
@@ -37,8 +50,10 @@
   git commit
   git push
 
-  Each repository can only perform one action at a time; each spawns their own thread
-  which is then kept
+  Each repository can only perform one action at a time; each gets its own worker the first
+  time an asynchronous action is requested, which is then kept, along with its own open
+  repository and remote handles, until the repository is collected. Workers are run on a
+  shared, bounded pool of threads.
 
   Test Cases:
 
@@ -51,13 +66,14 @@
 */
 #define API_GIT_REPO "Git.Repo"
 #define API_GIT_REMOTE "Git.Repo.Remote"
+#define API_GIT_LOG "Git.Repo.Log"
+#define API_GIT_DIFF "Git.Repo.Diff"
+#define API_GIT_SEARCH "Git.Repo.Search"
+#define API_GIT_CLONE "Git.Clone"
 
 
-static mbedtls_x509_crt x509_certificate;
 static mbedtls_entropy_context entropy_context;
 static mbedtls_ctr_drbg_context drbg_context;
-static mbedtls_ssl_config ssl_config;
-static mbedtls_ssl_context ssl_context;
 
 
 typedef struct {
@@ -70,6 +86,22 @@ typedef struct {
   #endif
 } thread_t;
 
+typedef struct {
+  #if _WIN32
+    CRITICAL_SECTION mutex;
+  #else
+    pthread_mutex_t mutex;
+  #endif
+} mutex_t;
+
+typedef struct {
+  #if _WIN32
+    CONDITION_VARIABLE cond;
+  #else
+    pthread_cond_t cond;
+  #endif
+} cond_t;
+
 
 #if _WIN32
 static DWORD windows_thread_callback(void* data) {
@@ -91,9 +123,122 @@ static thread_t* create_thread(void* (*func)(void*), void* data) {
   return thread;
 }
 
-static void close_thread(thread_t* thread) {
+static void* join_thread(thread_t* thread) {
+  void* retval;
   #if _WIN32
+    WaitForSingleObject(thread->thread, INFINITE);
     CloseHandle(thread->thread);
+    retval = thread->data;
+  #else
+    pthread_join(thread->thread, &retval);
+  #endif
+  free(thread);
+  return retval;
+}
+
+static mutex_t* create_mutex() {
+  mutex_t* mutex = malloc(sizeof(mutex_t));
+  #if _WIN32
+    InitializeCriticalSection(&mutex->mutex);
+  #else
+    pthread_mutex_init(&mutex->mutex, NULL);
+  #endif
+  return mutex;
+}
+
+static void close_mutex(mutex_t* mutex) {
+  #if _WIN32
+    DeleteCriticalSection(&mutex->mutex);
+  #else
+    pthread_mutex_destroy(&mutex->mutex);
+  #endif
+  free(mutex);
+}
+
+static void lock_mutex(mutex_t* mutex) {
+  #if _WIN32
+    EnterCriticalSection(&mutex->mutex);
+  #else
+    pthread_mutex_lock(&mutex->mutex);
+  #endif
+}
+
+static void unlock_mutex(mutex_t* mutex) {
+  #if _WIN32
+    LeaveCriticalSection(&mutex->mutex);
+  #else
+    pthread_mutex_unlock(&mutex->mutex);
+  #endif
+}
+
+static cond_t* create_cond() {
+  cond_t* cond = malloc(sizeof(cond_t));
+  #if _WIN32
+    InitializeConditionVariable(&cond->cond);
+  #else
+    pthread_cond_init(&cond->cond, NULL);
+  #endif
+  return cond;
+}
+
+static void close_cond(cond_t* cond) {
+  #if !_WIN32
+    pthread_cond_destroy(&cond->cond);
+  #endif
+  free(cond);
+}
+
+static void wait_cond(cond_t* cond, mutex_t* mutex) {
+  #if _WIN32
+    SleepConditionVariableCS(&cond->cond, &mutex->mutex, INFINITE);
+  #else
+    pthread_cond_wait(&cond->cond, &mutex->mutex);
+  #endif
+}
+
+static void timed_wait_cond(cond_t* cond, mutex_t* mutex, double seconds) {
+  #if _WIN32
+    SleepConditionVariableCS(&cond->cond, &mutex->mutex, (DWORD)(seconds * 1000));
+  #else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += (time_t)seconds;
+    ts.tv_nsec += (long)((seconds - (time_t)seconds) * 1000000000.0);
+    if (ts.tv_nsec >= 1000000000) {
+      ++ts.tv_sec;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&cond->cond, &mutex->mutex, &ts);
+  #endif
+}
+
+static void signal_cond(cond_t* cond) {
+  #if _WIN32
+    WakeConditionVariable(&cond->cond);
+  #else
+    pthread_cond_signal(&cond->cond);
+  #endif
+}
+
+static void broadcast_cond(cond_t* cond) {
+  #if _WIN32
+    WakeAllConditionVariable(&cond->cond);
+  #else
+    pthread_cond_broadcast(&cond->cond);
+  #endif
+}
+
+
+static double get_time() {
+  #if _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / frequency.QuadPart;
+  #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
   #endif
 }
 
@@ -104,17 +249,83 @@ static const char* git_error_last_string() {
 }
 
 
-static void lua_pushhex(lua_State* L, const char* hex, int length) {
+// Lookup tables for hex conversion; one two-character pair per byte going out, one nibble per character coming in
+// (-1 for anything that isn't a hex digit). Filled in when the module is loaded.
+static char hex_pairs[256][2];
+static signed char hex_nibbles[256];
+
+static void init_hex_tables() {
   static const char* hexDigits = "0123456789abcdef";
-  char buffer[1024];
-  int i;
-  for (i = 0; i < length && i < sizeof(buffer)/2; ++i) {
-    buffer[i*2] = hexDigits[hex[i] >> 4];
-    buffer[i*2+1] = hexDigits[hex[i] & 0xF];
+  for (int i = 0; i < 256; ++i) {
+    hex_pairs[i][0] = hexDigits[i >> 4];
+    hex_pairs[i][1] = hexDigits[i & 0xF];
+    hex_nibbles[i] = -1;
+  }
+  for (int i = 0; i < 16; ++i) {
+    hex_nibbles[(unsigned char)hexDigits[i]] = i;
+    hex_nibbles[toupper(hexDigits[i])] = i;
   }
+}
+
+static void hex_encode(char* hex, const unsigned char* raw, size_t length) {
+  for (size_t i = 0; i < length; ++i)
+    memcpy(&hex[i*2], hex_pairs[raw[i]], 2);
+}
+
+// Returns non-zero if the string wasn't valid hex.
+static int hex_decode(unsigned char* raw, const char* hex, size_t length) {
+  for (size_t i = 0; i < length; ++i) {
+    int high = hex_nibbles[(unsigned char)hex[i*2]], low = hex_nibbles[(unsigned char)hex[i*2+1]];
+    if (high < 0 || low < 0)
+      return -1;
+    raw[i] = (high << 4) | low;
+  }
+  return 0;
+}
+
+static void lua_pushhex(lua_State* L, const char* hex, int length) {
+  char buffer[GIT_OID_RAWSZ*2];
+  if (length > GIT_OID_RAWSZ)
+    length = GIT_OID_RAWSZ;
+  hex_encode(buffer, (const unsigned char*)hex, length);
   lua_pushlstring(L, buffer, length*2);
 }
 
+// Repositories with binary_oids set return object ids as 20-byte raw strings rather than 40-character hex; they're
+// cheaper to create, and cheaper to hash and compare as table keys. Either form is accepted anywhere an id is taken.
+static int lua_isbinaryoids(lua_State* L, int repo_idx) {
+  lua_getfield(L, repo_idx, "binary_oids");
+  int binary = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return binary;
+}
+
+static void lua_pushoid(lua_State* L, const git_oid* oid, int binary) {
+  if (binary)
+    lua_pushlstring(L, (const char*)oid->id, GIT_OID_RAWSZ);
+  else
+    lua_pushhex(L, (const char*)oid->id, GIT_OID_RAWSZ);
+}
+
+// Reads a revision: a reference name, a hex id, or a raw binary id; binary ids are converted to hex in the supplied buffer,
+// which must be at least GIT_OID_HEXSZ + 1 bytes. Raw ids are told apart from reference names by containing characters
+// a reference name can't.
+static const char* luaL_checkrevision(lua_State* L, int idx, char* buffer) {
+  size_t length;
+  const char* name = luaL_checklstring(L, idx, &length);
+  if (length != GIT_OID_RAWSZ)
+    return name;
+  for (size_t i = 0; i < length; ++i) {
+    unsigned char c = name[i];
+    if (c < 0x20 || c >= 0x7F || strchr(" ~^:?*[\\", c)) {
+      hex_encode(buffer, (const unsigned char*)name, GIT_OID_RAWSZ);
+      buffer[GIT_OID_HEXSZ] = 0;
+      return buffer;
+    }
+  }
+  return name;
+}
+
 static int git_get_id(git_oid* commit_id, git_repository* repository, const char* name) {
   int length = strlen(name);
   int is_hex = length == 40;
@@ -151,19 +362,23 @@ static void* luaL_checkinternal(lua_State *L, int idx, const char* type) {
   return internal;
 }
 
-static int f_git_init(lua_State* L) {
-  git_repository* repository;
-  if (git_repository_init(&repository, luaL_checkstring(L, 1), 0) != 0)
-    return luaL_error(L, "git init error: %s", git_error_last_string());
-  int has_credentials = lua_gettop(L) > 1;
+// Pushes a repository object for the handle; credentials_idx, if non-zero, is the stack index of its credentials table.
+static void lua_pushrepository(lua_State* L, git_repository* repository, int credentials_idx) {
   lua_newtable(L);
   luaL_setmetatable(L, API_GIT_REPO);
   lua_pushlightuserdata(L, repository);
   lua_setfield(L, -2, "internal");
-  if (has_credentials) {
-    lua_pushvalue(L, 2);
+  if (credentials_idx) {
+    lua_pushvalue(L, credentials_idx);
     lua_setfield(L, -2, "credentials");
   }
+}
+
+static int f_git_init(lua_State* L) {
+  git_repository* repository;
+  if (git_repository_init(&repository, luaL_checkstring(L, 1), 0) != 0)
+    return luaL_error(L, "git init error: %s", git_error_last_string());
+  lua_pushrepository(L, repository, lua_gettop(L) > 1 ? 2 : 0);
   return 1;
 }
 
@@ -172,15 +387,7 @@ static int f_git_open(lua_State* L) {
   git_repository* repository;
   if (git_repository_open(&repository, luaL_checkstring(L, 1)) != 0 && git_repository_init(&repository, luaL_checkstring(L, 1), 0) != 0)
     return luaL_error(L, "git open error: %s", git_error_last_string());
-  int has_credentials = lua_gettop(L) > 1;
-  lua_newtable(L);
-  luaL_setmetatable(L, API_GIT_REPO);
-  lua_pushlightuserdata(L, repository);
-  lua_setfield(L, -2, "internal");
-  if (has_credentials) {
-    lua_pushvalue(L, 2);
-    lua_setfield(L, -2, "credentials");
-  }
+  lua_pushrepository(L, repository, lua_gettop(L) > 1 ? 2 : 0);
   return 1;
 }
 
@@ -203,7 +410,8 @@ static int f_git_repo_create_load_remote(lua_State* L) {
 static int f_git_repo_create_load_branch(lua_State* L) {
   git_repository* repository = luaL_checkinternal(L, 1, API_GIT_REPO);
   const char* branch_name = luaL_checkstring(L, 2);
-  const char* commit_name = luaL_checkstring(L, 3);
+  char commit_hex[GIT_OID_HEXSZ + 1];
+  const char* commit_name = luaL_checkrevision(L, 3, commit_hex);
   git_reference* reference;
 
   int value = git_branch_lookup(&reference, repository, branch_name, GIT_BRANCH_LOCAL);
@@ -223,16 +431,100 @@ static int f_git_repo_create_load_branch(lua_State* L) {
   return 1;
 }
 
+typedef struct remote_handle_t {
+  struct remote_handle_t* next;
+  char* name;
+  git_remote* remote;
+  double last_used;
+} remote_handle_t;
+
+typedef struct operation_t operation_t;
+typedef struct status_cache_t status_cache_t;
+static void free_status_cache(status_cache_t* cache);
+typedef struct blame_cache_t blame_cache_t;
+static void free_blame_cache(blame_cache_t* cache);
+static int lua_getoptstrarray(lua_State* L, int idx, const char* field, git_strarray* array);
+
+// Each repository gets a worker, created the first time an asynchronous operation is requested. The worker keeps its own
+// repository handle, and any remotes it's looked up, open for the lifetime of the repository, so that successive
+// operations don't have to rediscover and reinitialize them. A worker isn't a thread; operations are queued on it in FIFO
+// order, and whenever it has any, it's scheduled onto the shared, bounded thread pool below. A worker is only ever run
+// by one pool thread at a time, so each repository still performs one action at a time.
+typedef struct worker_t {
+  struct worker_t* next;
+  // Every open worker is on the pool's list, so that idle threads can sweep their expired remotes.
+  struct worker_t* sibling;
+  char* path;
+  git_repository* repository;
+  remote_handle_t* remotes;
+  status_cache_t* status_cache;
+  blame_cache_t* blame_cache;
+  operation_t* head;
+  operation_t* tail;
+  int scheduled;
+  int closing;
+} worker_t;
+
+#define POOL_DEFAULT_THREADS 4
+#define POOL_DEFAULT_HELPERS 8
+
 typedef struct {
+  thread_t** threads;
+  int thread_count;
+  int max_threads;
+  int idle;
+  // Workers scheduled, but not yet claimed by a thread.
+  int pending;
+  int shutdown;
+  mutex_t* mutex;
+  cond_t* queued;
+  cond_t* completed;
+  worker_t* head;
+  worker_t* tail;
+  worker_t* workers;
+  // When the first cached remote of a worker no thread is running expires; 0 if there are none.
+  double next_sweep;
+  // Extra threads started by operations that fan their own work out, like checkouts; see pool_acquire_helpers.
+  int helpers;
+  int max_helpers;
+} pool_t;
+
+static pool_t pool;
+
+// Written by the pool thread as the transfer progresses, under the pool mutex; read by lua on each resume.
+typedef struct {
+  git_indexer_progress transfer;
+  unsigned int push_current;
+  unsigned int push_total;
+  size_t push_bytes;
+  size_t checkout_completed;
+  size_t checkout_total;
+  char message[256];
+  double started;
+  double finished;
+} progress_t;
+
+struct operation_t {
+  operation_t* next;
+  worker_t* worker;
+  const char* type;
+  // Run on a pool thread; returns non-zero on failure, with a libgit2 error set.
+  int (*callback)(worker_t* worker, operation_t* operation);
+  // Run on the lua thread once the operation has successfully completed; pushes its results, and frees anything the
+  // callback allocated. Operations that need more state embed operation_t as the first member of a larger struct.
+  int (*results)(lua_State* L, operation_t* operation);
   const char* username;
   const char* password;
-  const char* path;
   const char* remote;
   const char* branch;
-  thread_t* thread;
+  // Set for operations that create the worker's repository, rather than needing it opened.
+  int no_repository;
+  int progress_callback;
+  progress_t progress;
   volatile int complete;
+  double wait;
   char error[512];
-} operation_t;
+};
 
 static int credential_callback(git_credential** out, const char* url, const char* username_from_url, unsigned int allowed_types, void* payload) {
   operation_t* operation = payload;
@@ -240,65 +532,472 @@ static int credential_callback(git_credential** out, const char* url, const char
   return 0;
 }
 
-static void* git_remote_fetch_callback(void* data) {
-  operation_t* operation = (operation_t*)data;
-  git_repository* repository;
-  if (git_repository_open(&repository, operation->path)) {
-    strncpy(operation->error, git_error_last_string(), sizeof(operation->error));
-    return (void*)-1LL;
+static int transfer_progress_callback(const git_indexer_progress* stats, void* payload) {
+  operation_t* operation = payload;
+  lock_mutex(pool.mutex);
+  operation->progress.transfer = *stats;
+  unlock_mutex(pool.mutex);
+  return 0;
+}
+
+static int sideband_progress_callback(const char* str, int length, void* payload) {
+  operation_t* operation = payload;
+  if (length >= sizeof(operation->progress.message))
+    length = sizeof(operation->progress.message) - 1;
+  lock_mutex(pool.mutex);
+  memcpy(operation->progress.message, str, length);
+  operation->progress.message[length] = 0;
+  unlock_mutex(pool.mutex);
+  return 0;
+}
+
+static int push_transfer_progress_callback(unsigned int current, unsigned int total, size_t bytes, void* payload) {
+  operation_t* operation = payload;
+  lock_mutex(pool.mutex);
+  operation->progress.push_current = current;
+  operation->progress.push_total = total;
+  operation->progress.push_bytes = bytes;
+  unlock_mutex(pool.mutex);
+  return 0;
+}
+
+static void lua_pushprogress(lua_State* L, const progress_t* progress) {
+  lua_newtable(L);
+  lua_pushinteger(L, progress->transfer.total_objects); lua_setfield(L, -2, "total_objects");
+  lua_pushinteger(L, progress->transfer.received_objects); lua_setfield(L, -2, "received_objects");
+  lua_pushinteger(L, progress->transfer.indexed_objects); lua_setfield(L, -2, "indexed_objects");
+  lua_pushinteger(L, progress->transfer.local_objects); lua_setfield(L, -2, "local_objects");
+  lua_pushinteger(L, progress->transfer.total_deltas); lua_setfield(L, -2, "total_deltas");
+  lua_pushinteger(L, progress->transfer.indexed_deltas); lua_setfield(L, -2, "indexed_deltas");
+  lua_pushinteger(L, progress->transfer.received_bytes); lua_setfield(L, -2, "received_bytes");
+  lua_pushinteger(L, progress->push_current); lua_setfield(L, -2, "pushed_objects");
+  lua_pushinteger(L, progress->push_total); lua_setfield(L, -2, "push_objects");
+  lua_pushinteger(L, progress->push_bytes); lua_setfield(L, -2, "pushed_bytes");
+  lua_pushinteger(L, progress->checkout_completed); lua_setfield(L, -2, "checkout_completed");
+  lua_pushinteger(L, progress->checkout_total); lua_setfield(L, -2, "checkout_total");
+  lua_pushstring(L, progress->message); lua_setfield(L, -2, "message");
+  double elapsed = 0;
+  if (progress->finished > 0)
+    elapsed = progress->finished - progress->started;
+  else if (progress->started > 0)
+    elapsed = get_time() - progress->started;
+  lua_pushnumber(L, elapsed); lua_setfield(L, -2, "elapsed");
+}
+
+// A remote keeps its transport, and with it any kept-alive HTTPS connection and TLS session, between operations; and after
+// ls, it's left connected, so that a following fetch negotiates against the refs it just listed, rather than connecting
+// again. Remotes that have sat idle for longer than the timeout are freed, closing their connections, either the next
+// time the worker looks up a remote, or by an idle pool thread, which waits until the first remote is due to expire (and
+// without a timeout, if none are cached). Keeping a remote connected between operations needs libgit2 1.5, which resets
+// its callbacks on reuse.
+#define REMOTE_DEFAULT_IDLE_TIMEOUT 30
+#define REMOTE_KEEP_CONNECTED (LIBGIT2_VER_MAJOR > 1 || LIBGIT2_VER_MINOR >= 5)
+// Guarded by the pool mutex, as pool threads read it when sweeping.
+static double remote_idle_timeout = REMOTE_DEFAULT_IDLE_TIMEOUT;
+
+static void free_remote_handle(remote_handle_t* handle) {
+  git_remote_free(handle->remote);
+  free(handle->name);
+  free(handle);
+}
+
+// Only called by whichever thread has the worker scheduled.
+static void worker_sweep_remotes(worker_t* worker, double now, double timeout) {
+  for (remote_handle_t** link = &worker->remotes; *link;) {
+    remote_handle_t* handle = *link;
+    if (now - handle->last_used >= timeout) {
+      *link = handle->next;
+      free_remote_handle(handle);
+    } else
+      link = &handle->next;
   }
-  git_remote* remote;
-  if (git_remote_lookup(&remote, repository, operation->remote)) {
-    strncpy(operation->error, git_error_last_string(), sizeof(operation->error));
-    return (void*)-1LL;
+}
+
+// 0 if the worker has no remotes cached.
+static double worker_remote_expiry(worker_t* worker) {
+  double expiry = 0;
+  for (remote_handle_t* handle = worker->remotes; handle; handle = handle->next) {
+    if (!expiry || handle->last_used + remote_idle_timeout < expiry)
+      expiry = handle->last_used + remote_idle_timeout;
+  }
+  return expiry;
+}
+
+static int worker_has_expired_remote(worker_t* worker, double now) {
+  for (remote_handle_t* handle = worker->remotes; handle; handle = handle->next) {
+    if (now - handle->last_used >= remote_idle_timeout)
+      return 1;
+  }
+  return 0;
+}
+
+static git_remote* worker_remote(worker_t* worker, const char* name) {
+  double now = get_time();
+  git_remote* remote = NULL;
+  lock_mutex(pool.mutex);
+  double timeout = remote_idle_timeout;
+  unlock_mutex(pool.mutex);
+  worker_sweep_remotes(worker, now, timeout);
+  for (remote_handle_t* handle = worker->remotes; handle && !remote; handle = handle->next) {
+    if (strcmp(handle->name, name) == 0) {
+      handle->last_used = now;
+      remote = handle->remote;
+    }
+  }
+  if (remote)
+    return remote;
+  if (git_remote_lookup(&remote, worker->repository, name))
+    return NULL;
+  remote_handle_t* handle = malloc(sizeof(remote_handle_t));
+  handle->name = strdup(name);
+  handle->remote = remote;
+  handle->last_used = now;
+  handle->next = worker->remotes;
+  worker->remotes = handle;
+  return remote;
+}
+
+// Idle time is counted from the end of the last operation on the remote, not its start.
+static void worker_touch_remote(worker_t* worker, const char* name) {
+  for (remote_handle_t* handle = worker->remotes; handle; handle = handle->next) {
+    if (strcmp(handle->name, name) == 0)
+      handle->last_used = get_time();
   }
+}
+
+typedef struct {
+  operation_t operation;
+  git_strarray refspecs;
+  git_remote_autotag_option_t download_tags;
+  git_fetch_prune_t prune;
+  int depth;
+} fetch_operation_t;
+
+static int git_remote_fetch_callback(worker_t* worker, operation_t* operation) {
+  fetch_operation_t* fetch = (fetch_operation_t*)operation;
+  git_remote* remote = worker_remote(worker, operation->remote);
+  if (!remote)
+    return -1;
   git_fetch_options fetch_opts = GIT_FETCH_OPTIONS_INIT;
   fetch_opts.callbacks.credentials = credential_callback;
+  fetch_opts.callbacks.transfer_progress = transfer_progress_callback;
+  fetch_opts.callbacks.sideband_progress = sideband_progress_callback;
   fetch_opts.callbacks.payload = operation;
-  int code = git_remote_fetch(remote, NULL, &fetch_opts, NULL);
-  if (code)
-    strncpy(operation->error, git_error_last_string(), sizeof(operation->error));
-  operation->complete = 1;
-  git_remote_free(remote);
-  git_repository_free(repository);
-  return (void*)(long long)code;
+  fetch_opts.download_tags = fetch->download_tags;
+  fetch_opts.prune = fetch->prune;
+  #if LIBGIT2_VER_MAJOR > 1 || LIBGIT2_VER_MINOR >= 7
+    fetch_opts.depth = fetch->depth;
+  #endif
+  return git_remote_fetch(remote, fetch->refspecs.count ? &fetch->refspecs : NULL, &fetch_opts, NULL);
 }
 
 
-static void* git_remote_push_callback(void* data) {
-  operation_t* operation = (operation_t*)data;
-  git_repository* repository;
-  git_repository_open(&repository, operation->path);
-  git_remote* remote;
-  git_remote_lookup(&remote, repository, operation->remote);
+static int git_remote_push_callback(worker_t* worker, operation_t* operation) {
+  git_remote* remote = worker_remote(worker, operation->remote);
+  if (!remote)
+    return -1;
   git_push_options push_opts = GIT_PUSH_OPTIONS_INIT;
   push_opts.callbacks.credentials = credential_callback;
+  push_opts.callbacks.transfer_progress = transfer_progress_callback;
+  push_opts.callbacks.sideband_progress = sideband_progress_callback;
+  push_opts.callbacks.push_transfer_progress = push_transfer_progress_callback;
   push_opts.callbacks.payload = operation;
+  // A connection left open by ls is for fetching; pushes connect afresh, on the same transport.
+  git_remote_disconnect(remote);
   git_strarray array;
   array.strings = (char**)&operation->branch;
   array.count = 1;
-  int code = git_remote_push(remote, &array, &push_opts);
-  if (code)
-    strncpy(operation->error, git_error_last_string(), sizeof(operation->error));
-  git_remote_free(remote);
-  git_repository_free(repository);
-  operation->complete = 1;
-  return (void*)(long long)code;
+  return git_remote_push(remote, &array, &push_opts);
+}
+
+// For operations that write the index, HEAD or the worktree; the status cache can't be trusted to notice all of that
+// from stamps alone.
+static void worker_drop_status_cache(worker_t* worker) {
+  if (worker->status_cache) {
+    free_status_cache(worker->status_cache);
+    worker->status_cache = NULL;
+  }
+}
+
+static void free_worker(worker_t* worker) {
+  while (worker->remotes) {
+    remote_handle_t* handle = worker->remotes;
+    worker->remotes = handle->next;
+    free_remote_handle(handle);
+  }
+  if (worker->status_cache)
+    free_status_cache(worker->status_cache);
+  if (worker->blame_cache)
+    free_blame_cache(worker->blame_cache);
+  if (worker->repository)
+    git_repository_free(worker->repository);
+  free(worker->path);
+  free(worker);
+}
+
+// Must hold the pool mutex.
+static void pool_schedule(worker_t* worker) {
+  worker->scheduled = 1;
+  worker->next = NULL;
+  if (pool.tail)
+    pool.tail->next = worker;
+  else
+    pool.head = worker;
+  pool.tail = worker;
+  ++pool.pending;
+  signal_cond(pool.queued);
+}
+
+// Must hold the pool mutex. Claims each worker with expired remotes as if it were scheduled, so that nothing else runs
+// it, and frees them outside the lock; closing a connection can take a while. As the list may change while unlocked,
+// starts over after each one.
+static void pool_sweep_remotes() {
+  double now = get_time();
+  worker_t* worker = pool.workers;
+  while (worker) {
+    if (worker->scheduled || worker->closing || !worker_has_expired_remote(worker, now)) {
+      worker = worker->sibling;
+      continue;
+    }
+    worker->scheduled = 1;
+    double timeout = remote_idle_timeout;
+    unlock_mutex(pool.mutex);
+    worker_sweep_remotes(worker, now, timeout);
+    lock_mutex(pool.mutex);
+    if (worker->head)
+      pool_schedule(worker);
+    else {
+      worker->scheduled = 0;
+      if (worker->closing)
+        free_worker(worker);
+    }
+    worker = pool.workers;
+  }
+  // Workers being run are left to their threads, which bring this forward when they release them.
+  pool.next_sweep = 0;
+  for (worker = pool.workers; worker; worker = worker->sibling) {
+    double expiry = worker->scheduled ? 0 : worker_remote_expiry(worker);
+    if (expiry && (!pool.next_sweep || expiry < pool.next_sweep))
+      pool.next_sweep = expiry;
+  }
+}
+
+static void* pool_thread_callback(void* data) {
+  lock_mutex(pool.mutex);
+  --pool.idle;
+  while (1) {
+    while (!pool.head && !pool.shutdown) {
+      if (pool.next_sweep && get_time() >= pool.next_sweep)
+        pool_sweep_remotes();
+      if (pool.head)
+        break;
+      ++pool.idle;
+      double remaining = pool.next_sweep - get_time();
+      if (pool.next_sweep)
+        timed_wait_cond(pool.queued, pool.mutex, remaining > 0 ? remaining : 0);
+      else
+        wait_cond(pool.queued, pool.mutex);
+      --pool.idle;
+    }
+    worker_t* worker = pool.head;
+    if (!worker)
+      break;
+    --pool.pending;
+    pool.head = worker->next;
+    if (!pool.head)
+      pool.tail = NULL;
+    operation_t* operation = worker->head;
+    worker->head = operation->next;
+    if (!worker->head)
+      worker->tail = NULL;
+    int closing = worker->closing;
+    operation->progress.started = get_time();
+    unlock_mutex(pool.mutex);
+    int code = -1;
+    if (closing)
+      git_error_set_str(GIT_ERROR_INVALID, "repository closed");
+    else if (worker->repository || operation->no_repository || !git_repository_open(&worker->repository, worker->path))
+      code = operation->callback(worker, operation);
+    if (code && !operation->error[0])
+      strncpy(operation->error, git_error_last_string(), sizeof(operation->error) - 1);
+    if (operation->remote && !closing)
+      worker_touch_remote(worker, operation->remote);
+    lock_mutex(pool.mutex);
+    operation->progress.finished = get_time();
+    operation->complete = 1;
+    broadcast_cond(pool.completed);
+    // Go to the back of the line, so that one busy repository can't starve the others.
+    if (worker->head)
+      pool_schedule(worker);
+    else {
+      worker->scheduled = 0;
+      double expiry = worker->closing ? 0 : worker_remote_expiry(worker);
+      if (worker->closing)
+        free_worker(worker);
+      else if (expiry && (!pool.next_sweep || expiry < pool.next_sweep)) {
+        // Wakes an idle thread, if there is one, to wait on the new deadline.
+        pool.next_sweep = expiry;
+        signal_cond(pool.queued);
+      }
+    }
+  }
+  unlock_mutex(pool.mutex);
+  return NULL;
+}
+
+static void init_pool() {
+  pool.max_threads = POOL_DEFAULT_THREADS;
+  pool.max_helpers = POOL_DEFAULT_HELPERS;
+  pool.threads = calloc(pool.max_threads, sizeof(thread_t*));
+  pool.mutex = create_mutex();
+  pool.queued = create_cond();
+  pool.completed = create_cond();
+}
+
+static void close_pool() {
+  lock_mutex(pool.mutex);
+  pool.shutdown = 1;
+  broadcast_cond(pool.queued);
+  unlock_mutex(pool.mutex);
+  for (int i = 0; i < pool.thread_count; ++i)
+    join_thread(pool.threads[i]);
+  free(pool.threads);
+  close_cond(pool.completed);
+  close_cond(pool.queued);
+  close_mutex(pool.mutex);
+  memset(&pool, 0, sizeof(pool));
+}
+
+// Helper threads all come out of one budget, so that checkouts and searches running on several workers at once can't
+// each start their full complement. Returns how many of those wanted may be started, possibly none; the pool thread
+// asking always does its share of the work as well, so the operation still goes ahead.
+static int pool_acquire_helpers(int wanted) {
+  lock_mutex(pool.mutex);
+  int available = pool.max_helpers - pool.helpers;
+  int granted = wanted < available ? wanted : (available > 0 ? available : 0);
+  pool.helpers += granted;
+  unlock_mutex(pool.mutex);
+  return granted;
+}
+
+static void pool_release_helpers(int count) {
+  lock_mutex(pool.mutex);
+  pool.helpers -= count;
+  unlock_mutex(pool.mutex);
+}
+
+static worker_t* create_worker(const char* path) {
+  worker_t* worker = calloc(1, sizeof(worker_t));
+  worker->path = strdup(path);
+  lock_mutex(pool.mutex);
+  worker->sibling = pool.workers;
+  pool.workers = worker;
+  unlock_mutex(pool.mutex);
+  return worker;
+}
+
+// If the worker's in the middle of something, the pool thread running it will free it once it's done.
+static void close_worker(worker_t* worker) {
+  lock_mutex(pool.mutex);
+  for (worker_t** link = &pool.workers; *link; link = &(*link)->sibling) {
+    if (*link == worker) {
+      *link = worker->sibling;
+      break;
+    }
+  }
+  worker->closing = 1;
+  int scheduled = worker->scheduled;
+  unlock_mutex(pool.mutex);
+  if (!scheduled)
+    free_worker(worker);
+}
+
+static void worker_enqueue(worker_t* worker, operation_t* operation) {
+  operation->next = NULL;
+  operation->worker = worker;
+  operation->complete = 0;
+  operation->error[0] = 0;
+  memset(&operation->progress, 0, sizeof(operation->progress));
+  lock_mutex(pool.mutex);
+  if (worker->tail)
+    worker->tail->next = operation;
+  else
+    worker->head = operation;
+  worker->tail = operation;
+  if (!worker->scheduled) {
+    pool_schedule(worker);
+    // Threads are only spun up as they're needed, up to our limit; after that, work simply waits its turn. An idle thread
+    // that's been signalled may not have woken yet, so it's the unclaimed workers that are weighed against the idle
+    // threads, not just this one. New threads count as idle until they start.
+    while (pool.pending > pool.idle && pool.thread_count < pool.max_threads) {
+      ++pool.idle;
+      pool.threads[pool.thread_count++] = create_thread(pool_thread_callback, NULL);
+    }
+  }
+  unlock_mutex(pool.mutex);
+}
+
+static void worker_wait(worker_t* worker, operation_t* operation) {
+  lock_mutex(pool.mutex);
+  while (!operation->complete)
+    wait_cond(pool.completed, pool.mutex);
+  unlock_mutex(pool.mutex);
+}
+
+static worker_t* luaL_checkworker(lua_State* L, int idx) {
+  git_repository* repository = luaL_checkinternal(L, idx, API_GIT_REPO);
+  lua_getfield(L, idx, "worker");
+  worker_t* worker = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (!worker) {
+    worker = create_worker(git_repository_path(repository));
+    lua_pushlightuserdata(L, worker);
+    lua_setfield(L, idx < 0 ? idx - 1 : idx, "worker");
+  }
+  return worker;
+}
+
+// Lite-xl has no way to wake a coroutine from another thread, so we poll; but rather than a fixed interval,
+// we start very short (most local operations finish almost immediately), and back off geometrically, so that
+// long-running transfers only wake the scheduler a handful of times a second.
+#define OPERATION_POLL_MIN 0.001
+#define OPERATION_POLL_MAX 0.1
+
+// Calls the operation's progress callback, if it has one, with a snapshot of its progress. Returns -1 if the operation
+// is still running; otherwise pushes its results, which default to the final progress snapshot, and returns their count.
+static int f_git_operation_progress(lua_State* L, operation_t* operation) {
+  progress_t progress;
+  lock_mutex(pool.mutex);
+  int complete = operation->complete;
+  progress = operation->progress;
+  unlock_mutex(pool.mutex);
+  if (operation->progress_callback) {
+    lua_pushvalue(L, operation->progress_callback);
+    lua_pushprogress(L, &progress);
+    lua_call(L, 1, 0);
+  }
+  if (!complete)
+    return -1;
+  if (operation->error[0])
+    return luaL_error(L, "git %s error: %s", operation->type, operation->error);
+  if (operation->results)
+    return operation->results(L, operation);
+  lua_pushprogress(L, &progress);
+  return 1;
 }
 
-static int f_git_remote_operationk(lua_State* L, int status, lua_KContext ctx) {
+static int f_git_operationk(lua_State* L, int status, lua_KContext ctx) {
   lua_rawgeti(L, LUA_REGISTRYINDEX, (int)ctx);
   operation_t* operation = (operation_t*)lua_touserdata(L, -1);
-  if (operation->complete) {
+  lua_pop(L, 1);
+  int results = f_git_operation_progress(L, operation);
+  if (results >= 0) {
     luaL_unref(L, LUA_REGISTRYINDEX, (int)ctx);
-    close_thread(operation->thread);
-    if (operation->error[0])
-      return luaL_error(L, "git remote operation error: %s", operation->error);
-    return 0;
+    return results;
   }
-  lua_pushnumber(L, 0.05);
-  lua_yieldk(L, 1, ctx, f_git_remote_operationk);
-  return 0;
+  lua_pushnumber(L, operation->wait);
+  operation->wait = operation->wait * 2 < OPERATION_POLL_MAX ? operation->wait * 2 : OPERATION_POLL_MAX;
+  return lua_yieldk(L, 1, ctx, f_git_operationk);
 }
 
 static int lua_ismainthread(lua_State* L) {
@@ -307,211 +1006,3399 @@ static int lua_ismainthread(lua_State* L) {
   return is_main;
 }
 
+// Expects the operation userdata on the top of the stack. From a coroutine, yields until the worker has completed it;
+// from the main thread, simply blocks. Either way, returns the operation's results.
+static int f_git_operation(lua_State* L, worker_t* worker, operation_t* operation) {
+  worker_enqueue(worker, operation);
+  if (!lua_ismainthread(L)) {
+    operation->wait = OPERATION_POLL_MIN;
+    // Unreferenced in the continuation, once the operation is complete.
+    lua_pushvalue(L, -1);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+    return f_git_operationk(L, LUA_OK, (lua_KContext)ref);
+  }
+  worker_wait(worker, operation);
+  return f_git_operation_progress(L, operation);
+}
+
+// Allocates a zeroed operation userdata of the specified size on the top of the stack. Its user value can be used to keep
+// alive anything the operation refers to.
+static operation_t* lua_newoperation(lua_State* L, size_t size, const char* type, int (*callback)(worker_t*, operation_t*)) {
+  operation_t* operation = lua_newuserdatauv(L, size, 1);
+  memset(operation, 0, size);
+  operation->type = type;
+  operation->callback = callback;
+  return operation;
+}
+
+// Takes either a progress callback, or a table of options: refspecs (a refspec or table of them, in place of the remote's
+// configured ones), tags ("auto", "none" or "all"), prune, depth (needs libgit2 1.7) and progress.
 static int f_git_remote_fetch(lua_State* L) {
   git_remote* remote = luaL_checkinternal(L, 1, API_GIT_REMOTE);
+  if (!lua_isnoneornil(L, 2) && !lua_istable(L, 2))
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_settop(L, 2);
   lua_getfield(L, 1, "repo");
-  git_repository* repository = luaL_checkinternal(L, -1, API_GIT_REPO);
+  worker_t* worker = luaL_checkworker(L, -1);
   lua_getfield(L, -1, "credentials");
   luaL_checktype(L, -1, LUA_TTABLE);
   lua_getfield(L, -1, "username");
   lua_getfield(L, -2, "password");
-  operation_t* operation = lua_newuserdatauv(L, sizeof(operation_t), 0);
-  operation->username = luaL_checkstring(L, -3);
-  operation->password = luaL_checkstring(L, -2);
-  operation->path = git_repository_path(repository);
-  operation->complete = 0;
-  operation->error[0] = 0;
-  operation->remote = git_remote_name(remote);
-  if (!lua_ismainthread(L)) {
-    operation->thread = create_thread(git_remote_fetch_callback, operation);
-    int r = luaL_ref(L, LUA_REGISTRYINDEX);
-    lua_pushnumber(L, 0.05);
-    lua_yieldk(L, 1, (lua_KContext)r, f_git_remote_operationk);
-  } else {
-    if (git_remote_fetch_callback(&operation))
-      return luaL_error(L, "git remote operation error: %s", operation->error);
-  }
-  return 0;
+  fetch_operation_t* fetch = (fetch_operation_t*)lua_newoperation(L, sizeof(fetch_operation_t), "remote operation", git_remote_fetch_callback);
+  int operation_index = lua_gettop(L);
+  fetch->operation.username = luaL_checkstring(L, -3);
+  fetch->operation.password = luaL_checkstring(L, -2);
+  fetch->operation.remote = git_remote_name(remote);
+  if (lua_istable(L, 2)) {
+    lua_getoptstrarray(L, 2, "refspecs", &fetch->refspecs);
+    lua_getfield(L, 2, "tags");
+    const char* tags = luaL_optstring(L, -1, NULL);
+    if (!tags) fetch->download_tags = GIT_REMOTE_DOWNLOAD_TAGS_UNSPECIFIED;
+    else if (strcmp(tags, "auto") == 0) fetch->download_tags = GIT_REMOTE_DOWNLOAD_TAGS_AUTO;
+    else if (strcmp(tags, "none") == 0) fetch->download_tags = GIT_REMOTE_DOWNLOAD_TAGS_NONE;
+    else if (strcmp(tags, "all") == 0) fetch->download_tags = GIT_REMOTE_DOWNLOAD_TAGS_ALL;
+    else return luaL_error(L, "unknown tag download mode %s", tags);
+    lua_pop(L, 1);
+    if (lua_getfield(L, 2, "prune") != LUA_TNIL)
+      fetch->prune = lua_toboolean(L, -1) ? GIT_FETCH_PRUNE : GIT_FETCH_NO_PRUNE;
+    lua_pop(L, 1);
+    if (lua_getfield(L, 2, "depth") != LUA_TNIL) {
+      #if LIBGIT2_VER_MAJOR > 1 || LIBGIT2_VER_MINOR >= 7
+        fetch->depth = luaL_checkinteger(L, -1);
+      #else
+        return luaL_error(L, "shallow fetches require libgit2 1.7 or later");
+      #endif
+    }
+    lua_pop(L, 1);
+    if (lua_getfield(L, 2, "progress") != LUA_TNIL) {
+      luaL_checktype(L, -1, LUA_TFUNCTION);
+      lua_replace(L, 2);
+      fetch->operation.progress_callback = 2;
+    } else
+      lua_pop(L, 1);
+  } else
+    fetch->operation.progress_callback = lua_isfunction(L, 2) ? 2 : 0;
+  if (lua_gettop(L) != operation_index)
+    lua_pushvalue(L, operation_index);
+  return f_git_operation(L, worker, &fetch->operation);
 }
 
 static int f_git_remote_push(lua_State* L) {
   git_remote* remote = luaL_checkinternal(L, 1, API_GIT_REMOTE);
   const char* branch = luaL_checkstring(L, 2);
+  if (!lua_isnoneornil(L, 3))
+    luaL_checktype(L, 3, LUA_TFUNCTION);
   lua_getfield(L, 1, "repo");
-  git_repository* repository = luaL_checkinternal(L, -1, API_GIT_REPO);
+  worker_t* worker = luaL_checkworker(L, -1);
   lua_getfield(L, -1, "credentials");
   luaL_checktype(L, -1, LUA_TTABLE);
   lua_getfield(L, -1, "username");
   lua_getfield(L, -2, "password");
-  operation_t* operation = lua_newuserdatauv(L, sizeof(operation_t), 0);
+  operation_t* operation = lua_newoperation(L, sizeof(operation_t), "remote operation", git_remote_push_callback);
   operation->username = luaL_checkstring(L, -3);
   operation->password = luaL_checkstring(L, -2);
-  operation->path = git_repository_path(repository);
-  operation->complete = 0;
-  operation->error[0] = 0;
   operation->remote = git_remote_name(remote);
   operation->branch = branch;
-  if (!lua_ismainthread(L)) {
-    operation->thread = create_thread(git_remote_push_callback, operation);
-    int r = luaL_ref(L, LUA_REGISTRYINDEX);
-    lua_pushnumber(L, 0.05);
-    lua_yieldk(L, 1, (lua_KContext)r, f_git_remote_operationk);
-  } else {
-    if (git_remote_push_callback(&operation))
-      return luaL_error(L, "git remote operation error: %s", operation->error);
+  operation->progress_callback = lua_isfunction(L, 3) ? 3 : 0;
+  return f_git_operation(L, worker, operation);
+}
+
+
+typedef struct {
+  char** strings;
+  size_t count;
+  size_t capacity;
+} string_list_t;
+
+static void string_list_push(string_list_t* list, const char* str, size_t length) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 16;
+    list->strings = realloc(list->strings, sizeof(char*) * list->capacity);
   }
-  return 0;
+  char* copy = malloc(length + 1);
+  memcpy(copy, str, length);
+  copy[length] = 0;
+  list->strings[list->count++] = copy;
 }
 
+static void string_list_free(string_list_t* list) {
+  for (size_t i = 0; i < list->count; ++i)
+    free(list->strings[i]);
+  free(list->strings);
+  memset(list, 0, sizeof(string_list_t));
+}
 
-static int f_git_repo_reset(lua_State* L) {
-  git_repository* repository = luaL_checkinternal(L, 1, API_GIT_REPO);
-  const char* commit_name = luaL_checkstring(L, 2);
-  const char* type = luaL_checkstring(L, 3);
-  git_commit* commit = git_retrieve_commit(L, repository, commit_name);
-  git_reset_t reset_type = GIT_RESET_SOFT;
-  if (strcmp(type, "mixed") == 0)
-    reset_type = GIT_RESET_MIXED;
-  else if (strcmp(type, "hard") == 0)
-    reset_type = GIT_RESET_HARD;
-  int result = git_reset(repository, (git_object*)commit, reset_type, NULL);
-  git_commit_free(commit);
-  if (result)
-    return luaL_error(L, "git reset error: %s", git_error_last_string());
-  return 0;
+static int string_compare(const void* a, const void* b) {
+  return strcmp(*(const char**)a, *(const char**)b);
 }
 
+typedef struct {
+  operation_t operation;
+  int binary;
+  string_list_t names;
+  git_oid* ids;
+} ls_operation_t;
 
+static int git_remote_ls_callback(worker_t* worker, operation_t* operation) {
+  ls_operation_t* ls = (ls_operation_t*)operation;
+  git_remote* remote = worker_remote(worker, operation->remote);
+  if (!remote)
+    return -1;
+  git_remote_callbacks callbacks = GIT_REMOTE_CALLBACKS_INIT;
+  callbacks.credentials = credential_callback;
+  callbacks.payload = operation;
+  const git_remote_head** heads;
+  size_t count;
+  // Always reconnects, so that the refs are current; the connection's then left open for a following fetch.
+  git_remote_disconnect(remote);
+  int error = git_remote_connect(remote, GIT_DIRECTION_FETCH, &callbacks, NULL, NULL);
+  if (!error)
+    error = git_remote_ls(&heads, &count, remote);
+  if (!error) {
+    ls->ids = malloc(sizeof(git_oid) * (count ? count : 1));
+    for (size_t i = 0; i < count; ++i) {
+      string_list_push(&ls->names, heads[i]->name, strlen(heads[i]->name));
+      git_oid_cpy(&ls->ids[i], &heads[i]->oid);
+    }
+  }
+  if (error || !REMOTE_KEEP_CONNECTED)
+    git_remote_disconnect(remote);
+  return error;
+}
 
-// returns a string if a fast-forward (the commit to use), true if a merge is required, false if no merge required.
-static int f_git_repo_merge(lua_State* L) {
-  git_repository* repository = luaL_checkinternal(L, 1, API_GIT_REPO);
-  const char* commit_name = luaL_checkstring(L, 2);
+static int git_remote_ls_results(lua_State* L, operation_t* operation) {
+  ls_operation_t* ls = (ls_operation_t*)operation;
+  lua_createtable(L, 0, ls->names.count);
+  for (size_t i = 0; i < ls->names.count; ++i) {
+    lua_pushoid(L, &ls->ids[i], ls->binary);
+    lua_setfield(L, -2, ls->names.strings[i]);
+  }
+  string_list_free(&ls->names);
+  free(ls->ids);
+  ls->ids = NULL;
+  return 1;
+}
+
+// Returns a table of the remote's advertised refs, name to id, without fetching anything.
+static int f_git_remote_ls(lua_State* L) {
+  git_remote* remote = luaL_checkinternal(L, 1, API_GIT_REMOTE);
+  lua_getfield(L, 1, "repo");
+  worker_t* worker = luaL_checkworker(L, -1);
+  int binary = lua_isbinaryoids(L, -1);
+  lua_getfield(L, -1, "credentials");
+  luaL_checktype(L, -1, LUA_TTABLE);
+  lua_getfield(L, -1, "username");
+  lua_getfield(L, -2, "password");
+  ls_operation_t* ls = (ls_operation_t*)lua_newoperation(L, sizeof(ls_operation_t), "remote operation", git_remote_ls_callback);
+  ls->operation.username = luaL_checkstring(L, -3);
+  ls->operation.password = luaL_checkstring(L, -2);
+  ls->operation.remote = git_remote_name(remote);
+  ls->operation.results = git_remote_ls_results;
+  ls->binary = binary;
+  return f_git_operation(L, worker, &ls->operation);
+}
+
+// libgit2 checks out files one at a time, on one thread; on flash storage with many small files, that's dominated by the
+// latency of each open/write/close. For hard resets and clean merges, we instead work out which regular files need to be
+// written or removed ourselves, fan the blob inflation and writing out over a number of threads (the pool thread, plus
+// helpers from the pool's shared budget, each with its own repository handle, as those aren't thread-safe), and then only
+// let libgit2 update the index, plus any leftover symlinks, submodules, type changes or conflicts we don't handle.
+#define CHECKOUT_DEFAULT_WORKERS 4
+static int checkout_workers = CHECKOUT_DEFAULT_WORKERS;
+
+typedef struct {
+  const char* path;
+  git_oid id;
+  uint16_t mode;
+} checkout_file_t;
+
+typedef struct {
+  const char* repository_path;
+  const char* workdir;
+  checkout_file_t* files;
+  size_t count;
+  size_t next;
+  mutex_t* mutex;
+  operation_t* operation;
+  int failed;
+  char error[512];
+} checkout_t;
+
+typedef struct {
+  checkout_file_t* writes;
+  size_t write_count;
+  string_list_t removes;
+  string_list_t leftovers;
+} checkout_plan_t;
+
+static int checkout_progress_callback(const char* path, size_t completed, size_t total, void* payload) {
+  operation_t* operation = payload;
+  lock_mutex(pool.mutex);
+  operation->progress.checkout_completed = completed;
+  operation->progress.checkout_total = total;
+  unlock_mutex(pool.mutex);
+  return 0;
+}
+
+static int checkout_is_file(uint16_t mode) {
+  return mode == GIT_FILEMODE_BLOB || mode == GIT_FILEMODE_BLOB_EXECUTABLE;
+}
+
+static void checkout_mkdir(char* path) {
+  for (char* slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = 0;
+    #if _WIN32
+      mkdir(path);
+    #else
+      mkdir(path, 0777);
+    #endif
+    *slash = '/';
+  }
+}
+
+static int checkout_write_file(git_repository* repository, const char* workdir, const checkout_file_t* file) {
+  char path[4096];
+  git_blob* blob;
+  git_buf buffer = { 0 };
+  git_blob_filter_options options = GIT_BLOB_FILTER_OPTIONS_INIT;
+  snprintf(path, sizeof(path), "%s%s", workdir, file->path);
+  if (git_blob_lookup(&blob, repository, &file->id))
+    return -1;
+  // Applies the same attribute-driven filters (line endings, etc.) as libgit2's own checkout.
+  int error = git_blob_filter(&buffer, blob, file->path, &options);
+  git_blob_free(blob);
+  if (error)
+    return error;
+  FILE* handle = fopen(path, "wb");
+  if (!handle) {
+    checkout_mkdir(path);
+    handle = fopen(path, "wb");
+  }
+  if (!handle || fwrite(buffer.ptr, sizeof(char), buffer.size, handle) != buffer.size) {
+    git_error_set_str(GIT_ERROR_OS, strerror(errno));
+    error = -1;
+  }
+  if (handle)
+    fclose(handle);
+  git_buf_dispose(&buffer);
+  #if !_WIN32
+    if (!error)
+      chmod(path, file->mode == GIT_FILEMODE_BLOB_EXECUTABLE ? 0755 : 0644);
+  #endif
+  return error;
+}
+
+static void* checkout_thread_callback(void* data) {
+  checkout_t* checkout = data;
+  git_repository* repository = NULL;
+  int error = git_repository_open(&repository, checkout->repository_path);
+  while (!error) {
+    lock_mutex(checkout->mutex);
+    size_t i = checkout->next++;
+    int done = checkout->failed || i >= checkout->count;
+    unlock_mutex(checkout->mutex);
+    if (done)
+      break;
+    error = checkout_write_file(repository, checkout->workdir, &checkout->files[i]);
+    lock_mutex(pool.mutex);
+    ++checkout->operation->progress.checkout_completed;
+    unlock_mutex(pool.mutex);
+  }
+  if (error) {
+    lock_mutex(checkout->mutex);
+    if (!checkout->failed)
+      strncpy(checkout->error, git_error_last_string(), sizeof(checkout->error) - 1);
+    checkout->failed = 1;
+    unlock_mutex(checkout->mutex);
+  }
+  if (repository)
+    git_repository_free(repository);
+  return NULL;
+}
+
+// Removes the file, and any directories that removing it left empty.
+static void checkout_remove_file(const char* workdir, const char* file) {
+  char path[4096];
+  size_t workdir_length = strlen(workdir);
+  snprintf(path, sizeof(path), "%s%s", workdir, file);
+  if (remove(path))
+    return;
+  for (char* slash = strrchr(path, '/'); slash && slash > &path[workdir_length]; slash = strrchr(path, '/')) {
+    *slash = 0;
+    if (rmdir(path))
+      break;
+  }
+}
+
+// Sorts the deltas of a diff into files to write, files to remove, and leftovers for libgit2. The target side of each
+// delta is the new file, unless reversed.
+static void checkout_plan(git_diff* diff, int reversed, checkout_plan_t* plan) {
+  size_t count = git_diff_num_deltas(diff);
+  plan->writes = malloc(sizeof(checkout_file_t) * (count + 1));
+  for (size_t i = 0; i < count; ++i) {
+    const git_diff_delta* delta = git_diff_get_delta(diff, i);
+    const git_diff_file* target = reversed ? &delta->old_file : &delta->new_file;
+    const git_diff_file* current = reversed ? &delta->new_file : &delta->old_file;
+    git_delta_t status = delta->status;
+    if (reversed && status == GIT_DELTA_ADDED)
+      status = GIT_DELTA_DELETED;
+    else if (reversed && status == GIT_DELTA_DELETED)
+      status = GIT_DELTA_ADDED;
+    if ((status == GIT_DELTA_MODIFIED || status == GIT_DELTA_ADDED) && checkout_is_file(target->mode) && (!current->mode || checkout_is_file(current->mode))) {
+      checkout_file_t* file = &plan->writes[plan->write_count++];
+      file->path = target->path;
+      file->id = target->id;
+      file->mode = target->mode;
+    } else if (status == GIT_DELTA_DELETED && current->mode != GIT_FILEMODE_COMMIT)
+      // Symlinks too; left to libgit2, one that's only staged would be untracked after the reset, and survive it.
+      string_list_push(&plan->removes, current->path, strlen(current->path));
+    else
+      string_list_push(&plan->leftovers, target->path ? target->path : current->path, strlen(target->path ? target->path : current->path));
+  }
+}
+
+static void free_checkout_plan(checkout_plan_t* plan) {
+  free(plan->writes);
+  string_list_free(&plan->removes);
+  string_list_free(&plan->leftovers);
+}
+
+static int checkout_execute(worker_t* worker, operation_t* operation, checkout_plan_t* plan, int workers) {
+  const char* workdir = git_repository_workdir(worker->repository);
+  checkout_t checkout = { worker->path, workdir, plan->writes, plan->write_count, 0, create_mutex(), operation, 0, "" };
+  if (workers > plan->write_count)
+    workers = plan->write_count;
+  // Removed first, so that a file replaced by a directory of the same name, or the other way round, is out of the way
+  // before anything's written in its place.
+  for (size_t i = 0; i < plan->removes.count; ++i)
+    checkout_remove_file(workdir, plan->removes.strings[i]);
+  lock_mutex(pool.mutex);
+  operation->progress.checkout_completed = 0;
+  operation->progress.checkout_total = plan->write_count;
+  unlock_mutex(pool.mutex);
+  int helpers = workers > 1 ? pool_acquire_helpers(workers - 1) : 0;
+  thread_t** threads = malloc(sizeof(thread_t*) * (helpers + 1));
+  for (int i = 0; i < helpers; ++i)
+    threads[i] = create_thread(checkout_thread_callback, &checkout);
+  if (plan->write_count)
+    checkout_thread_callback(&checkout);
+  for (int i = 0; i < helpers; ++i)
+    join_thread(threads[i]);
+  free(threads);
+  pool_release_helpers(helpers);
+  close_mutex(checkout.mutex);
+  if (checkout.failed) {
+    snprintf(operation->error, sizeof(operation->error), "checkout error: %s", checkout.error);
+    return -1;
+  }
+  return 0;
+}
+
+// Checks out the leftovers with libgit2, from an index which has already been updated to the target.
+static int checkout_leftovers(worker_t* worker, operation_t* operation, checkout_plan_t* plan) {
+  if (!plan->leftovers.count)
+    return 0;
+  git_checkout_options checkout_options;
+  git_checkout_options_init(&checkout_options, GIT_CHECKOUT_OPTIONS_VERSION);
+  checkout_options.checkout_strategy = GIT_CHECKOUT_FORCE | GIT_CHECKOUT_DISABLE_PATHSPEC_MATCH;
+  checkout_options.paths.strings = plan->leftovers.strings;
+  checkout_options.paths.count = plan->leftovers.count;
+  return git_checkout_index(worker->repository, NULL, &checkout_options);
+}
+
+// Equivalent to a hard reset: the worktree is made to match the commit's tree, then a mixed reset moves HEAD and the index.
+static int checkout_reset_hard(worker_t* worker, operation_t* operation, git_commit* commit, int workers) {
+  git_tree* tree;
+  git_diff* diff;
+  checkout_plan_t plan = { 0 };
+  git_diff_options diff_options;
+  git_diff_options_init(&diff_options, GIT_DIFF_OPTIONS_VERSION);
+  diff_options.flags = GIT_DIFF_INCLUDE_TYPECHANGE | GIT_DIFF_IGNORE_SUBMODULES;
+  if (git_commit_tree(&tree, commit))
+    return -1;
+  int error = git_diff_tree_to_workdir_with_index(&diff, worker->repository, tree, &diff_options);
+  git_tree_free(tree);
+  if (error)
+    return error;
+  checkout_plan(diff, 1, &plan);
+  error = checkout_execute(worker, operation, &plan, workers);
+  if (!error)
+    error = git_reset(worker->repository, (git_object*)commit, GIT_RESET_MIXED, NULL);
+  if (!error)
+    error = checkout_leftovers(worker, operation, &plan);
+  free_checkout_plan(&plan);
+  git_diff_free(diff);
+  return error;
+}
+
+static int checkout_write_state(worker_t* worker, const char* name, const char* contents) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s%s", worker->path, name);
+  FILE* file = fopen(path, "wb");
+  if (!file) {
+    git_error_set_str(GIT_ERROR_OS, strerror(errno));
+    return -1;
+  }
+  fputs(contents, file);
+  fclose(file);
+  return 0;
+}
+
+// Equivalent to git_merge for merges without conflicts, where none of the files the merge touches have been modified.
+// Returns GIT_EUSER if the merge isn't suitable, in which case nothing has been changed, and git_merge should be used.
+static int checkout_merge(worker_t* worker, operation_t* operation, const git_oid* commit_id, int workers) {
+  git_repository* repository = worker->repository;
+  git_commit *ours = NULL, *theirs = NULL;
+  git_index *merged = NULL, *index = NULL;
+  git_tree *head_tree = NULL, *merged_tree = NULL;
+  git_diff *diff = NULL, *dirty = NULL;
+  git_oid head_id, tree_id;
+  checkout_plan_t plan = { 0 };
+  string_list_t paths = { 0 };
+  git_merge_options merge_options;
+  git_merge_options_init(&merge_options, GIT_MERGE_OPTIONS_VERSION);
+  git_diff_options diff_options;
+  git_diff_options_init(&diff_options, GIT_DIFF_OPTIONS_VERSION);
+  diff_options.flags = GIT_DIFF_INCLUDE_TYPECHANGE | GIT_DIFF_IGNORE_SUBMODULES;
+  int error;
+  if ((error = git_reference_name_to_id(&head_id, repository, "HEAD")) ||
+      (error = git_commit_lookup(&ours, repository, &head_id)) ||
+      (error = git_commit_lookup(&theirs, repository, commit_id)) ||
+      (error = git_merge_commits(&merged, repository, ours, theirs, &merge_options)))
+    goto cleanup;
+  if (git_index_has_conflicts(merged)) {
+    error = GIT_EUSER;
+    goto cleanup;
+  }
+  if ((error = git_index_write_tree_to(&tree_id, merged, repository)) ||
+      (error = git_tree_lookup(&merged_tree, repository, &tree_id)) ||
+      (error = git_commit_tree(&head_tree, ours)) ||
+      (error = git_diff_tree_to_tree(&diff, repository, head_tree, merged_tree, &diff_options)))
+    goto cleanup;
+  size_t count = git_diff_num_deltas(diff);
+  for (size_t i = 0; i < count; ++i) {
+    const git_diff_delta* delta = git_diff_get_delta(diff, i);
+    string_list_push(&paths, delta->old_file.path, strlen(delta->old_file.path));
+    if (strcmp(delta->old_file.path, delta->new_file.path) != 0)
+      string_list_push(&paths, delta->new_file.path, strlen(delta->new_file.path));
+  }
+  if (paths.count) {
+    diff_options.flags |= GIT_DIFF_DISABLE_PATHSPEC_MATCH | GIT_DIFF_INCLUDE_UNTRACKED;
+    diff_options.pathspec.strings = paths.strings;
+    diff_options.pathspec.count = paths.count;
+    if ((error = git_diff_tree_to_workdir_with_index(&dirty, repository, head_tree, &diff_options)))
+      goto cleanup;
+    if (git_diff_num_deltas(dirty) > 0) {
+      error = GIT_EUSER;
+      goto cleanup;
+    }
+  }
+  checkout_plan(diff, 0, &plan);
+  char message[128], head[GIT_OID_HEXSZ + 2] = { 0 };
+  git_oid_fmt(head, commit_id);
+  head[GIT_OID_HEXSZ] = '\n';
+  snprintf(message, sizeof(message), "Merge commit '%.*s'\n", GIT_OID_HEXSZ, head);
+  if ((error = checkout_execute(worker, operation, &plan, workers)) ||
+      (error = git_repository_index(&index, repository)) ||
+      (error = git_index_read_tree(index, merged_tree)) ||
+      (error = git_index_write(index)) ||
+      (error = checkout_leftovers(worker, operation, &plan)) ||
+      (error = checkout_write_state(worker, "MERGE_HEAD", head)) ||
+      (error = checkout_write_state(worker, "MERGE_MODE", "")) ||
+      (error = checkout_write_state(worker, "MERGE_MSG", message)))
+    goto cleanup;
+  cleanup:
+  free_checkout_plan(&plan);
+  string_list_free(&paths);
+  if (dirty) git_diff_free(dirty);
+  if (diff) git_diff_free(diff);
+  if (head_tree) git_tree_free(head_tree);
+  if (merged_tree) git_tree_free(merged_tree);
+  if (index) git_index_free(index);
+  if (merged) git_index_free(merged);
+  if (theirs) git_commit_free(theirs);
+  if (ours) git_commit_free(ours);
+  return error;
+}
+
+// Reads the optional options table shared by reset and merge: workers, the number of threads used to write files
+// (1 uses libgit2's own checkout), and progress, a callback receiving progress snapshots.
+static int lua_getcheckoutoptions(lua_State* L, int idx, operation_t* operation) {
+  int workers = checkout_workers;
+  if (lua_istable(L, idx)) {
+    if (lua_getfield(L, idx, "workers") != LUA_TNIL)
+      workers = luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+    if (lua_getfield(L, idx, "progress") != LUA_TNIL) {
+      luaL_checktype(L, -1, LUA_TFUNCTION);
+      lua_replace(L, idx);
+      operation->progress_callback = idx;
+    } else
+      lua_pop(L, 1);
+  }
+  return workers;
+}
+
+// A version of git_retrieve_commit usable from a pool thread; sets the operation's error on failure.
+static int git_operation_commit(git_commit** commit, git_repository* repository, const char* commit_name, operation_t* operation) {
+  git_oid commit_id;
+  if (git_get_id(&commit_id, repository, commit_name)) {
+    snprintf(operation->error, sizeof(operation->error), "reference lookup error: %s", git_error_last_string());
+    return -1;
+  }
+  if (git_commit_lookup(commit, repository, &commit_id)) {
+    snprintf(operation->error, sizeof(operation->error), "commit lookup error: %s", git_error_last_string());
+    return -1;
+  }
+  return 0;
+}
+
+typedef struct {
+  operation_t operation;
+  const char* commit_name;
+  char commit_hex[GIT_OID_HEXSZ + 1];
+  git_reset_t type;
+  int workers;
+} reset_operation_t;
+
+static int git_repo_reset_callback(worker_t* worker, operation_t* operation) {
+  reset_operation_t* reset = (reset_operation_t*)operation;
+  worker_drop_status_cache(worker);
+  git_commit* commit;
+  if (git_operation_commit(&commit, worker->repository, reset->commit_name, operation))
+    return -1;
+  int result;
+  if (reset->type == GIT_RESET_HARD && reset->workers > 1)
+    result = checkout_reset_hard(worker, operation, commit, reset->workers);
+  else {
+    git_checkout_options checkout_options;
+    git_checkout_options_init(&checkout_options, GIT_CHECKOUT_OPTIONS_VERSION);
+    checkout_options.checkout_strategy = GIT_CHECKOUT_FORCE;
+    checkout_options.progress_cb = checkout_progress_callback;
+    checkout_options.progress_payload = operation;
+    result = git_reset(worker->repository, (git_object*)commit, reset->type, &checkout_options);
+  }
+  git_commit_free(commit);
+  return result;
+}
+
+// Returns the final progress snapshot, which for a hard reset includes the number of files written, and the time taken.
+static int f_git_repo_reset(lua_State* L) {
+  worker_t* worker = luaL_checkworker(L, 1);
+  const char* type = luaL_checkstring(L, 3);
+  lua_settop(L, 4);
+  reset_operation_t* reset = (reset_operation_t*)lua_newoperation(L, sizeof(reset_operation_t), "reset", git_repo_reset_callback);
+  reset->workers = lua_getcheckoutoptions(L, 4, &reset->operation);
+  reset->commit_name = luaL_checkrevision(L, 2, reset->commit_hex);
+  reset->type = GIT_RESET_SOFT;
+  if (strcmp(type, "mixed") == 0)
+    reset->type = GIT_RESET_MIXED;
+  else if (strcmp(type, "hard") == 0)
+    reset->type = GIT_RESET_HARD;
+  return f_git_operation(L, worker, &reset->operation);
+}
+
+
+typedef struct {
+  operation_t operation;
+  const char* commit_name;
+  char commit_hex[GIT_OID_HEXSZ + 1];
   git_oid commit_id;
+  int workers;
+  enum { MERGE_NONE, MERGE_FAST_FORWARD, MERGE_MERGED } result;
+} merge_operation_t;
+
+static int git_repo_merge_callback(worker_t* worker, operation_t* operation) {
+  merge_operation_t* merge = (merge_operation_t*)operation;
+  worker_drop_status_cache(worker);
+  git_repository* repository = worker->repository;
   git_annotated_commit* commit;
   git_merge_options merge_options;
   git_merge_options_init(&merge_options, GIT_MERGE_OPTIONS_VERSION);
   git_checkout_options checkout_options;
   git_checkout_options_init(&checkout_options, GIT_CHECKOUT_OPTIONS_VERSION);
-  if (git_get_id(&commit_id, repository, commit_name))
-    return luaL_error(L, "git reference lookup error: %s", git_error_last_string());
+  if (git_get_id(&merge->commit_id, repository, merge->commit_name)) {
+    snprintf(operation->error, sizeof(operation->error), "reference lookup error: %s", git_error_last_string());
+    return -1;
+  }
   // Determine if a fast-forward. If it is, report 0. If we need to actually merge,
   git_oid merge_base, master_id;
-  if (git_get_id(&master_id, repository, "refs/heads/master"))
-    return luaL_error(L, "git reference lookup error: %s", git_error_last_string());
-  if (git_merge_base(&merge_base, repository, &master_id, &commit_id))
-    return luaL_error(L, "git merge base error: %s", git_error_last_string());
+  if (git_get_id(&master_id, repository, "refs/heads/master")) {
+    snprintf(operation->error, sizeof(operation->error), "reference lookup error: %s", git_error_last_string());
+    return -1;
+  }
+  if (git_merge_base(&merge_base, repository, &master_id, &merge->commit_id)) {
+    snprintf(operation->error, sizeof(operation->error), "merge base error: %s", git_error_last_string());
+    return -1;
+  }
   // If merge base is the merging in commit, we've already merged it.
-  if (memcmp(merge_base.id, commit_id.id, sizeof(merge_base.id)) == 0) {
-    lua_pushboolean(L, 0);
-    return 1;
+  if (memcmp(merge_base.id, merge->commit_id.id, sizeof(merge_base.id)) == 0) {
+    merge->result = MERGE_NONE;
+    return 0;
   // If merge base is the same as master, this is a fast forward, and we should return the commit id of the merging in branch.
   } else if (memcmp(merge_base.id, master_id.id, sizeof(merge_base.id)) == 0) {
-    lua_pushhex(L, (char*)commit_id.id, sizeof(commit_id.id));
-    return 1;
+    merge->result = MERGE_FAST_FORWARD;
+    return 0;
+  }
+  if (merge->workers > 1) {
+    int result = checkout_merge(worker, operation, &merge->commit_id, merge->workers);
+    if (result != GIT_EUSER) {
+      merge->result = MERGE_MERGED;
+      return result;
+    }
+  }
+  checkout_options.progress_cb = checkout_progress_callback;
+  checkout_options.progress_payload = operation;
+  if (git_annotated_commit_lookup(&commit, repository, &merge->commit_id)) {
+    snprintf(operation->error, sizeof(operation->error), "commit lookup error: %s", git_error_last_string());
+    return -1;
+  }
+  int result = git_merge(repository, (const git_annotated_commit**)&commit, 1, &merge_options, &checkout_options);
+  git_annotated_commit_free(commit);
+  if (result)
+    return result;
+  git_index* index;
+  if (git_repository_index(&index, repository))
+    return -1;
+  int has_conflicts = git_index_has_conflicts(index);
+  git_index_free(index);
+  if (has_conflicts) {
+    snprintf(operation->error, sizeof(operation->error), "merge has conflicts");
+    return -1;
+  }
+  merge->result = MERGE_MERGED;
+  return 0;
+}
+
+static int git_repo_merge_results(lua_State* L, operation_t* operation) {
+  merge_operation_t* merge = (merge_operation_t*)operation;
+  if (merge->result == MERGE_FAST_FORWARD)
+    lua_pushoid(L, &merge->commit_id, lua_isbinaryoids(L, 1));
+  else
+    lua_pushboolean(L, merge->result == MERGE_MERGED);
+  lua_pushprogress(L, &operation->progress);
+  return 2;
+}
+
+// returns a string if a fast-forward (the commit to use), true if a merge is required, false if no merge required.
+// Also returns the final progress snapshot.
+static int f_git_repo_merge(lua_State* L) {
+  worker_t* worker = luaL_checkworker(L, 1);
+  lua_settop(L, 3);
+  merge_operation_t* merge = (merge_operation_t*)lua_newoperation(L, sizeof(merge_operation_t), "merge", git_repo_merge_callback);
+  merge->operation.results = git_repo_merge_results;
+  merge->workers = lua_getcheckoutoptions(L, 3, &merge->operation);
+  merge->commit_name = luaL_checkrevision(L, 2, merge->commit_hex);
+  return f_git_operation(L, worker, &merge->operation);
+}
+
+
+typedef struct {
+  operation_t operation;
+  const char* message;
+  const char* name;
+  const char* email;
+  git_oid commit_id;
+} commit_operation_t;
+
+static int git_repo_commit_callback(worker_t* worker, operation_t* operation) {
+  commit_operation_t* commit_operation = (commit_operation_t*)operation;
+  worker_drop_status_cache(worker);
+  git_repository* repository = worker->repository;
+  git_signature *me = NULL;
+  git_commit* commit = NULL;
+  git_index *index = NULL;
+  git_tree* tree = NULL;
+  git_oid tree_id;
+  int error = -1;
+  if (git_signature_now(&me, commit_operation->name, commit_operation->email))
+    goto cleanup;
+  if (git_operation_commit(&commit, repository, "HEAD", operation))
+    goto cleanup;
+  if (git_repository_index(&index, repository)) {
+    snprintf(operation->error, sizeof(operation->error), "index error: %s", git_error_last_string());
+    goto cleanup;
+  }
+  if (git_index_write_tree(&tree_id, index)) {
+    snprintf(operation->error, sizeof(operation->error), "write tree error: %s", git_error_last_string());
+    goto cleanup;
+  }
+  if (git_tree_lookup(&tree, repository, &tree_id)) {
+    snprintf(operation->error, sizeof(operation->error), "tree lookup error: %s", git_error_last_string());
+    goto cleanup;
+  }
+  error = git_commit_create(
+    &commit_operation->commit_id,
+    repository,
+    "HEAD",                      /* name of ref to update */
+    me,                          /* author */
+    me,                          /* committer */
+    "UTF-8",                     /* message encoding */
+    commit_operation->message,   /* message */
+    tree,                        /* root tree */
+    1,                           /* parent count */
+    (const git_commit**)&commit);                    /* parents */
+  cleanup:
+  if (tree)
+    git_tree_free(tree);
+  if (index)
+    git_index_free(index);
+  if (commit)
+    git_commit_free(commit);
+  if (me)
+    git_signature_free(me);
+  return error;
+}
+
+static int git_repo_commit_results(lua_State* L, operation_t* operation) {
+  commit_operation_t* commit = (commit_operation_t*)operation;
+  lua_pushoid(L, &commit->commit_id, lua_isbinaryoids(L, 1));
+  return 1;
+}
+
+static int f_git_repo_commit(lua_State* L) {
+  worker_t* worker = luaL_checkworker(L, 1);
+  const char* commit_message = luaL_checkstring(L, 2);
+  lua_getfield(L, 1, "credentials");
+  lua_getfield(L, -1, "email");
+  const char* email = luaL_checkstring(L, -1);
+  lua_getfield(L, -2, "name");
+  const char* name = luaL_checkstring(L, -1);
+  commit_operation_t* commit = (commit_operation_t*)lua_newoperation(L, sizeof(commit_operation_t), "commit", git_repo_commit_callback);
+  commit->operation.results = git_repo_commit_results;
+  commit->message = commit_message;
+  commit->name = name;
+  commit->email = email;
+  return f_git_operation(L, worker, &commit->operation);
+}
+
+static int f_git_repo_lookup(lua_State* L) {
+  git_repository* repository = luaL_checkinternal(L, 1, API_GIT_REPO);
+  char commit_hex[GIT_OID_HEXSZ + 1];
+  const char* commit_name = luaL_checkrevision(L, 2, commit_hex);
+  git_oid commit_id;
+  if (git_get_id(&commit_id, repository, commit_name))
+    return luaL_error(L, "git reference lookup error: %s", git_error_last_string());
+  lua_pushoid(L, &commit_id, lua_isbinaryoids(L, 1));
+  return 1;
+}
+
+// Reads a string or table of strings from the specified index into a git_strarray. The array itself is allocated as a userdata,
+// pushed onto the stack; it, and the source strings, must be kept alive for as long as the array is in use.
+static void luaL_checkstrarray(lua_State* L, int idx, git_strarray* array) {
+  if (lua_istable(L, idx)) {
+    array->count = lua_rawlen(L, idx);
+    array->strings = lua_newuserdatauv(L, sizeof(char*) * (array->count ? array->count : 1), 0);
+    for (size_t i = 0; i < array->count; ++i) {
+      if (lua_rawgeti(L, idx, i + 1) != LUA_TSTRING)
+        luaL_error(L, "expected a string at index %d", (int)i + 1);
+      array->strings[i] = (char*)lua_tostring(L, -1);
+      lua_pop(L, 1);
+    }
+  } else {
+    array->count = 1;
+    array->strings = lua_newuserdatauv(L, sizeof(char*), 0);
+    array->strings[0] = (char*)luaL_checkstring(L, idx);
+  }
+}
+
+typedef struct {
+  operation_t operation;
+  git_strarray paths;
+  string_list_t matched;
+} add_operation_t;
+
+static int matched_path_callback(const char *path, const char *matched_pathspec, void *payload) {
+  string_list_t* matched = payload;
+  string_list_push(matched, path, strlen(path));
+  return 0;
+}
+
+static int git_repo_add_callback(worker_t* worker, operation_t* operation) {
+  add_operation_t* add = (add_operation_t*)operation;
+  worker_drop_status_cache(worker);
+  git_index *index;
+  if (git_repository_index(&index, worker->repository)) {
+    snprintf(operation->error, sizeof(operation->error), "index error: %s", git_error_last_string());
+    return -1;
+  }
+  int value = git_index_read(index, 0);
+  if (!value && add->paths.count)
+    value = git_index_add_all(index, &add->paths, GIT_INDEX_ADD_FORCE, matched_path_callback, &add->matched);
+  if (!value && add->matched.count)
+    value = git_index_write(index);
+  git_index_free(index);
+  return value;
+}
+
+static int git_repo_add_results(lua_State* L, operation_t* operation) {
+  add_operation_t* add = (add_operation_t*)operation;
+  lua_createtable(L, add->matched.count, 0);
+  for (size_t i = 0; i < add->matched.count; ++i) {
+    lua_pushstring(L, add->matched.strings[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  string_list_free(&add->matched);
+  return 1;
+}
+
+// Accepts either a single path, or a table of paths and/or pathspecs; all of them are staged with one read and one write
+// of the index. Returns a table of the paths that were actually added, changed or removed.
+static int f_git_repo_add(lua_State* L) {
+  worker_t* worker = luaL_checkworker(L, 1);
+  git_strarray paths;
+  luaL_checkstrarray(L, 2, &paths);
+  add_operation_t* add = (add_operation_t*)lua_newoperation(L, sizeof(add_operation_t), "add", git_repo_add_callback);
+  add->operation.results = git_repo_add_results;
+  add->paths = paths;
+  return f_git_operation(L, worker, &add->operation);
+}
+
+typedef struct {
+  char* path;
+  unsigned int flags;
+} status_entry_t;
+
+typedef struct {
+  char* path;
+  time_t mtime;
+} status_directory_t;
+
+// The index ends in a checksum of its contents, so its last bytes change whenever it's rewritten with anything different,
+// even within the same second and at the same size, which its mtime and size alone would miss. Enough bytes are kept for
+// a SHA-256 checksum.
+#define STATUS_STAMP_SIZE 32
+
+typedef struct {
+  long size;
+  unsigned char checksum[STATUS_STAMP_SIZE];
+} status_stamp_t;
+
+// The last status of the worktree, kept on the worker. Both arrays are kept sorted by path. Rather than rescanning the whole
+// worktree, a refresh only rescans paths the editor tells us have changed, and the contents of directories whose mtime
+// has moved since the last scan (which catches files created, deleted or renamed behind the editor's back). Anything that
+// could change the status of arbitrary files, like a new HEAD, a rewritten index, or different scan flags, drops the cache.
+struct status_cache_t {
+  unsigned int flags;
+  git_oid head;
+  status_stamp_t index;
+  time_t scanned;
+  status_entry_t* entries;
+  size_t entry_count;
+  status_directory_t* directories;
+  size_t directory_count;
+};
+
+static int status_entry_compare(const void* a, const void* b) {
+  return strcmp(((const status_entry_t*)a)->path, ((const status_entry_t*)b)->path);
+}
+
+static int status_directory_compare(const void* a, const void* b) {
+  return strcmp(((const status_directory_t*)a)->path, ((const status_directory_t*)b)->path);
+}
+
+static void free_status_entries(status_entry_t* entries, size_t count) {
+  for (size_t i = 0; i < count; ++i)
+    free(entries[i].path);
+  free(entries);
+}
+
+static void free_status_cache(status_cache_t* cache) {
+  free_status_entries(cache->entries, cache->entry_count);
+  for (size_t i = 0; i < cache->directory_count; ++i)
+    free(cache->directories[i].path);
+  free(cache->directories);
+  free(cache);
+}
+
+// Appends the contents of a status list to an array of entries, growing it as necessary.
+static void status_list_entries(git_status_list* list, status_entry_t** entries, size_t* count) {
+  size_t length = git_status_list_entrycount(list);
+  *entries = realloc(*entries, sizeof(status_entry_t) * (*count + length + 1));
+  for (size_t i = 0; i < length; ++i) {
+    const git_status_entry* entry = git_status_byindex(list, i);
+    const git_diff_delta* delta = entry->index_to_workdir ? entry->index_to_workdir : entry->head_to_index;
+    (*entries)[*count].path = strdup(delta->new_file.path ? delta->new_file.path : delta->old_file.path);
+    (*entries)[*count].flags = entry->status;
+    ++*count;
+  }
+}
+
+static int git_stat(const char* root, const char* path, struct stat* st) {
+  char buffer[4096];
+  snprintf(buffer, sizeof(buffer), "%s%s", root, path);
+  return stat(buffer, st);
+}
+
+// Directories modified in the same second as a scan may be modified again without their mtime moving, so we record
+// them as always needing a rescan until they settle down.
+// -1 for a directory modified too recently to trust its mtime, as it may change again within the second; -2 for one
+// that's gone.
+static time_t status_directory_mtime(const char* workdir, const char* path, time_t scanned) {
+  struct stat st;
+  if (git_stat(workdir, path, &st))
+    return -2;
+  return st.st_mtime >= scanned ? -1 : st.st_mtime;
+}
+
+static void status_cache_stamp(worker_t* worker, git_oid* head, status_stamp_t* index) {
+  char path[4096];
+  memset(head, 0, sizeof(git_oid));
+  memset(index, 0, sizeof(status_stamp_t));
+  git_reference_name_to_id(head, worker->repository, "HEAD");
+  snprintf(path, sizeof(path), "%s%s", worker->path, "index");
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return;
+  if (!fseek(file, 0, SEEK_END) && (index->size = ftell(file)) > 0) {
+    long length = index->size < STATUS_STAMP_SIZE ? index->size : STATUS_STAMP_SIZE;
+    if (fseek(file, -length, SEEK_END) || fread(index->checksum, 1, length, file) != (size_t)length)
+      index->size = -1;
+  }
+  fclose(file);
+}
+
+static int status_cache_rebuild(worker_t* worker, const git_status_options* options) {
+  git_status_options full_options = *options;
+  git_status_list* list;
+  git_index* index;
+  // Lets libgit2 write back refreshed stat data, so that files it had to hash this time won't need hashing next time.
+  full_options.flags |= GIT_STATUS_OPT_UPDATE_INDEX;
+  if (worker->status_cache) {
+    free_status_cache(worker->status_cache);
+    worker->status_cache = NULL;
+  }
+  status_cache_t* cache = calloc(1, sizeof(status_cache_t));
+  cache->flags = options->flags;
+  cache->scanned = time(NULL);
+  if (git_status_list_new(&list, worker->repository, &full_options)) {
+    free_status_cache(cache);
+    return -1;
+  }
+  status_list_entries(list, &cache->entries, &cache->entry_count);
+  git_status_list_free(list);
+  qsort(cache->entries, cache->entry_count, sizeof(status_entry_t), status_entry_compare);
+  // We take our directories from the index, as it's far cheaper than walking the worktree; untracked directories are
+  // picked up as they appear in their tracked parents.
+  if (git_repository_index(&index, worker->repository)) {
+    free_status_cache(cache);
+    return -1;
+  }
+  string_list_t directories = { 0 };
+  string_list_push(&directories, "", 0);
+  size_t count = git_index_entrycount(index);
+  for (size_t i = 0; i < count; ++i) {
+    const char* path = git_index_get_byindex(index, i)->path;
+    for (const char* slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+      const char* last = directories.strings[directories.count - 1];
+      if (strncmp(last, path, slash - path) != 0 || last[slash - path] != 0)
+        string_list_push(&directories, path, slash - path);
+    }
+  }
+  git_index_free(index);
+  qsort(directories.strings, directories.count, sizeof(char*), string_compare);
+  cache->directories = malloc(sizeof(status_directory_t) * directories.count);
+  const char* workdir = git_repository_workdir(worker->repository);
+  for (size_t i = 0; i < directories.count; ++i) {
+    if (cache->directory_count > 0 && strcmp(cache->directories[cache->directory_count - 1].path, directories.strings[i]) == 0) {
+      free(directories.strings[i]);
+      continue;
+    }
+    cache->directories[cache->directory_count].path = directories.strings[i];
+    cache->directories[cache->directory_count].mtime = status_directory_mtime(workdir, directories.strings[i], cache->scanned);
+    ++cache->directory_count;
+  }
+  free(directories.strings);
+  status_cache_stamp(worker, &cache->head, &cache->index);
+  worker->status_cache = cache;
+  return 0;
+}
+
+static int status_cache_has_directory(status_cache_t* cache, const char* path) {
+  status_directory_t key = { (char*)path, 0 };
+  return bsearch(&key, cache->directories, cache->directory_count, sizeof(status_directory_t), status_directory_compare) != NULL;
+}
+
+// Adds every path directly inside a directory that has changed: the files currently there, anything the index or the
+// cache thinks is there, and the entirety of any new subdirectories.
+static void status_cache_directory_paths(worker_t* worker, git_index* index, const char* directory, string_list_t* paths, string_list_t* new_directories) {
+  status_cache_t* cache = worker->status_cache;
+  const char* workdir = git_repository_workdir(worker->repository);
+  char buffer[4096];
+  size_t prefix_length = directory[0] ? snprintf(buffer, sizeof(buffer), "%s/", directory) : 0;
+  buffer[prefix_length] = 0;
+  char full_path[4096];
+  snprintf(full_path, sizeof(full_path), "%s%s", workdir, buffer);
+  DIR* dir = opendir(full_path);
+  if (dir) {
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || (!directory[0] && strcmp(entry->d_name, ".git") == 0))
+        continue;
+      snprintf(&buffer[prefix_length], sizeof(buffer) - prefix_length, "%s", entry->d_name);
+      struct stat st;
+      if (!git_stat(workdir, buffer, &st) && S_ISDIR(st.st_mode)) {
+        if (!status_cache_has_directory(cache, buffer)) {
+          string_list_push(paths, buffer, strlen(buffer));
+          string_list_push(new_directories, buffer, strlen(buffer));
+        }
+      } else
+        string_list_push(paths, buffer, strlen(buffer));
+    }
+    closedir(dir);
+  }
+  buffer[prefix_length] = 0;
+  size_t position = 0;
+  if (prefix_length == 0 || !git_index_find_prefix(&position, index, buffer)) {
+    size_t count = git_index_entrycount(index);
+    for (size_t i = position; i < count; ++i) {
+      const char* path = git_index_get_byindex(index, i)->path;
+      if (strncmp(path, buffer, prefix_length) != 0)
+        break;
+      if (!strchr(&path[prefix_length], '/'))
+        string_list_push(paths, path, strlen(path));
+    }
+  }
+  for (size_t i = 0; i < cache->entry_count; ++i) {
+    const char* path = cache->entries[i].path;
+    if (strncmp(path, buffer, prefix_length) == 0 && !strchr(&path[prefix_length], '/'))
+      string_list_push(paths, path, strlen(path));
+  }
+}
+
+// Whether a path is one of the sorted pathspecs, or is inside one of them.
+static int status_path_matches(const string_list_t* pathspecs, const char* path) {
+  char buffer[4096];
+  snprintf(buffer, sizeof(buffer), "%s", path);
+  while (1) {
+    const char* key = buffer;
+    if (bsearch(&key, pathspecs->strings, pathspecs->count, sizeof(char*), string_compare))
+      return 1;
+    char* slash = strrchr(buffer, '/');
+    if (!slash)
+      return 0;
+    *slash = 0;
+  }
+}
+
+static int status_cache_refresh(worker_t* worker, const git_status_options* options, const git_strarray* changed) {
+  status_cache_t* cache = worker->status_cache;
+  git_oid head;
+  status_stamp_t index_stamp;
+  status_cache_stamp(worker, &head, &index_stamp);
+  if (!cache || cache->flags != options->flags || !git_oid_equal(&head, &cache->head) || index_stamp.size < 0 || memcmp(&index_stamp, &cache->index, sizeof(status_stamp_t)) != 0)
+    return status_cache_rebuild(worker, options);
+  string_list_t paths = { 0 }, new_directories = { 0 };
+  git_index* index;
+  if (git_repository_index(&index, worker->repository))
+    return -1;
+  if (git_index_read(index, 0)) {
+    git_index_free(index);
+    return -1;
+  }
+  for (size_t i = 0; i < changed->count; ++i)
+    string_list_push(&paths, changed->strings[i], strlen(changed->strings[i]));
+  const char* workdir = git_repository_workdir(worker->repository);
+  time_t scanned = time(NULL);
+  size_t kept_directories = 0;
+  for (size_t i = 0; i < cache->directory_count; ++i) {
+    time_t mtime = status_directory_mtime(workdir, cache->directories[i].path, scanned);
+    if (mtime < 0 || mtime != cache->directories[i].mtime) {
+      status_cache_directory_paths(worker, index, cache->directories[i].path, &paths, &new_directories);
+      cache->directories[i].mtime = mtime;
+    }
+    // A deleted directory's paths only need rescanning the once; if it comes back, its parent's mtime will show it.
+    if (mtime == -2)
+      free(cache->directories[i].path);
+    else
+      cache->directories[kept_directories++] = cache->directories[i];
+  }
+  cache->directory_count = kept_directories;
+  git_index_free(index);
+  if (new_directories.count) {
+    cache->directories = realloc(cache->directories, sizeof(status_directory_t) * (cache->directory_count + new_directories.count));
+    for (size_t i = 0; i < new_directories.count; ++i) {
+      cache->directories[cache->directory_count].path = new_directories.strings[i];
+      cache->directories[cache->directory_count++].mtime = status_directory_mtime(workdir, new_directories.strings[i], scanned);
+    }
+    free(new_directories.strings);
+    qsort(cache->directories, cache->directory_count, sizeof(status_directory_t), status_directory_compare);
+  }
+  if (paths.count == 0)
+    return 0;
+  qsort(paths.strings, paths.count, sizeof(char*), string_compare);
+  git_status_options scoped_options = *options;
+  git_status_list* list;
+  scoped_options.pathspec.strings = paths.strings;
+  scoped_options.pathspec.count = paths.count;
+  // Literal paths; a name with glob characters in it mustn't pull in entries for other files.
+  scoped_options.flags |= GIT_STATUS_OPT_UPDATE_INDEX | GIT_STATUS_OPT_DISABLE_PATHSPEC_MATCH;
+  if (git_status_list_new(&list, worker->repository, &scoped_options)) {
+    string_list_free(&paths);
+    return -1;
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < cache->entry_count; ++i) {
+    if (status_path_matches(&paths, cache->entries[i].path))
+      free(cache->entries[i].path);
+    else
+      cache->entries[kept++] = cache->entries[i];
+  }
+  cache->entry_count = kept;
+  status_list_entries(list, &cache->entries, &cache->entry_count);
+  git_status_list_free(list);
+  qsort(cache->entries, cache->entry_count, sizeof(status_entry_t), status_entry_compare);
+  string_list_free(&paths);
+  // Updating the index's stat data may have rewritten it; that was us, so don't invalidate ourselves next time.
+  status_cache_stamp(worker, &cache->head, &cache->index);
+  return 0;
+}
+
+typedef struct {
+  operation_t operation;
+  git_status_options options;
+  git_strarray changed;
+  int cached;
+  int refresh;
+  status_entry_t* entries;
+  size_t count;
+} status_operation_t;
+
+static int git_repo_status_callback(worker_t* worker, operation_t* operation) {
+  status_operation_t* status = (status_operation_t*)operation;
+  if (!status->cached) {
+    git_status_list* list;
+    if (git_status_list_new(&list, worker->repository, &status->options))
+      return -1;
+    status_list_entries(list, &status->entries, &status->count);
+    git_status_list_free(list);
+    return 0;
+  }
+  if (status->refresh ? status_cache_rebuild(worker, &status->options) : status_cache_refresh(worker, &status->options, &status->changed))
+    return -1;
+  // The cache can be modified by the next operation as soon as this one completes, so lua gets a copy.
+  status_cache_t* cache = worker->status_cache;
+  status->entries = malloc(sizeof(status_entry_t) * (cache->entry_count + 1));
+  for (size_t i = 0; i < cache->entry_count; ++i) {
+    status->entries[i].path = strdup(cache->entries[i].path);
+    status->entries[i].flags = cache->entries[i].flags;
+  }
+  status->count = cache->entry_count;
+  return 0;
+}
+
+// Packed as a flat array of alternating paths and status flags, to avoid creating a table per file.
+static int git_repo_status_results(lua_State* L, operation_t* operation) {
+  status_operation_t* status = (status_operation_t*)operation;
+  lua_createtable(L, status->count * 2, 0);
+  for (size_t i = 0; i < status->count; ++i) {
+    lua_pushstring(L, status->entries[i].path);
+    lua_rawseti(L, -2, i * 2 + 1);
+    lua_pushinteger(L, status->entries[i].flags);
+    lua_rawseti(L, -2, i * 2 + 2);
+  }
+  free_status_entries(status->entries, status->count);
+  status->entries = NULL;
+  return 1;
+}
+
+static int lua_getoptinteger(lua_State* L, int idx, const char* field, lua_Integer* value) {
+  int has_value = lua_getfield(L, idx, field) != LUA_TNIL;
+  if (has_value)
+    *value = luaL_checkinteger(L, -1);
+  lua_pop(L, 1);
+  return has_value;
+}
+
+static int lua_getoptboolean(lua_State* L, int idx, const char* field, int def) {
+  int value = lua_getfield(L, idx, field) == LUA_TNIL ? def : lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return value;
+}
+
+// If the table at the specified index has the field, reads it into the array with luaL_checkstrarray, leaving both the
+// field and the array on the stack; otherwise pushes nothing.
+static int lua_getoptstrarray(lua_State* L, int idx, const char* field, git_strarray* array) {
+  if (lua_getfield(L, idx, field) == LUA_TNIL) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  luaL_checkstrarray(L, -1, array);
+  return 1;
+}
+
+// Takes an optional table of options: untracked (default true), ignored (default false), and either pathspec (a string or
+// table of strings, scoping a one-off scan), or changed (a table of paths the editor knows it has modified since the last
+// call) and refresh (forces a full rescan). Without a pathspec, results come from the repository's status cache.
+// Returns a flat array of path, flags, path, flags, ...; the flags are libgit2.STATUS bits.
+static int f_git_repo_status(lua_State* L) {
+  worker_t* worker = luaL_checkworker(L, 1);
+  int has_options = lua_istable(L, 2);
+  status_operation_t* status = (status_operation_t*)lua_newoperation(L, sizeof(status_operation_t), "status", git_repo_status_callback);
+  int operation_index = lua_gettop(L);
+  status->operation.results = git_repo_status_results;
+  git_status_options_init(&status->options, GIT_STATUS_OPTIONS_VERSION);
+  status->options.show = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
+  status->options.flags = GIT_STATUS_OPT_EXCLUDE_SUBMODULES;
+  status->cached = 1;
+  if (!has_options || lua_getoptboolean(L, 2, "untracked", 1))
+    status->options.flags |= GIT_STATUS_OPT_INCLUDE_UNTRACKED | GIT_STATUS_OPT_RECURSE_UNTRACKED_DIRS;
+  if (has_options) {
+    if (lua_getoptboolean(L, 2, "ignored", 0))
+      status->options.flags |= GIT_STATUS_OPT_INCLUDE_IGNORED;
+    status->refresh = lua_getoptboolean(L, 2, "refresh", 0);
+    if (lua_getoptstrarray(L, 2, "pathspec", &status->options.pathspec))
+      status->cached = 0;
+    lua_getoptstrarray(L, 2, "changed", &status->changed);
+  }
+  if (lua_gettop(L) != operation_index)
+    lua_pushvalue(L, operation_index);
+  return f_git_operation(L, worker, &status->operation);
+}
+
+typedef struct {
+  git_oid id;
+  git_oid* parents;
+  unsigned int parent_count;
+  char* author;
+  git_time_t time;
+  char* summary;
+} log_entry_t;
+
+// A log is a single operation that's re-queued on the worker for each batch; the revision walker lives on between them,
+// bound to the worker's repository handle, which is only ever used by one pool thread at a time.
+typedef struct {
+  operation_t operation;
+  worker_t* worker;
+  git_revwalk* walk;
+  unsigned int sort;
+  string_list_t starts;
+  string_list_t paths;
+  int binary;
+  int done;
+  log_entry_t* entries;
+  size_t count;
+  size_t batch_size;
+} log_operation_t;
+
+#define LOG_DEFAULT_BATCH_SIZE 256
+
+static void free_log_entries(log_operation_t* log) {
+  for (size_t i = 0; i < log->count; ++i) {
+    free(log->entries[i].parents);
+    free(log->entries[i].author);
+    free(log->entries[i].summary);
+  }
+  log->count = 0;
+}
+
+// Compares the entries for each of the paths in two trees, either of which may be missing.
+static int log_trees_differ(git_tree* a, git_tree* b, const string_list_t* paths) {
+  for (size_t i = 0; i < paths->count; ++i) {
+    git_tree_entry *entry_a = NULL, *entry_b = NULL;
+    if (a)
+      git_tree_entry_bypath(&entry_a, a, paths->strings[i]);
+    if (b)
+      git_tree_entry_bypath(&entry_b, b, paths->strings[i]);
+    int differ = (!entry_a != !entry_b) || (entry_a && !git_oid_equal(git_tree_entry_id(entry_a), git_tree_entry_id(entry_b)));
+    git_tree_entry_free(entry_a);
+    git_tree_entry_free(entry_b);
+    if (differ)
+      return 1;
+  }
+  return 0;
+}
+
+// As with git's default history simplification, a commit is shown if it changes one of the paths relative to each of its
+// parents; a merge that took the paths unchanged from any one side is skipped.
+static int log_commit_touches(git_commit* commit, const string_list_t* paths, int* touches) {
+  git_tree* tree;
+  if (git_commit_tree(&tree, commit))
+    return -1;
+  unsigned int parent_count = git_commit_parentcount(commit);
+  *touches = parent_count == 0 ? log_trees_differ(tree, NULL, paths) : 1;
+  for (unsigned int i = 0; i < parent_count && *touches; ++i) {
+    git_commit* parent;
+    git_tree* parent_tree;
+    if (git_commit_parent(&parent, commit, i)) {
+      git_tree_free(tree);
+      return -1;
+    }
+    int error = git_commit_tree(&parent_tree, parent);
+    git_commit_free(parent);
+    if (error) {
+      git_tree_free(tree);
+      return -1;
+    }
+    *touches = log_trees_differ(tree, parent_tree, paths);
+    git_tree_free(parent_tree);
+  }
+  git_tree_free(tree);
+  return 0;
+}
+
+static int git_repo_log_callback(worker_t* worker, operation_t* operation) {
+  log_operation_t* log = (log_operation_t*)operation;
+  // Anything left over from a batch that failed part way through.
+  free_log_entries(log);
+  if (!log->walk) {
+    if (git_revwalk_new(&log->walk, worker->repository))
+      return -1;
+    git_revwalk_sorting(log->walk, log->sort);
+    for (size_t i = 0; i < log->starts.count; ++i) {
+      git_oid id;
+      if (git_get_id(&id, worker->repository, log->starts.strings[i]) || git_revwalk_push(log->walk, &id))
+        return -1;
+    }
+    if (!log->starts.count && git_revwalk_push_head(log->walk))
+      return -1;
+  }
+  git_oid id;
+  int error;
+  while (log->count < log->batch_size && !(error = git_revwalk_next(&id, log->walk))) {
+    git_commit* commit;
+    if (git_commit_lookup(&commit, worker->repository, &id))
+      return -1;
+    int touches = 1;
+    if (log->paths.count && log_commit_touches(commit, &log->paths, &touches)) {
+      git_commit_free(commit);
+      return -1;
+    }
+    if (touches) {
+      log_entry_t* entry = &log->entries[log->count++];
+      const git_signature* author = git_commit_author(commit);
+      const char* summary = git_commit_summary(commit);
+      git_oid_cpy(&entry->id, &id);
+      entry->parent_count = git_commit_parentcount(commit);
+      entry->parents = malloc(sizeof(git_oid) * (entry->parent_count ? entry->parent_count : 1));
+      for (unsigned int i = 0; i < entry->parent_count; ++i)
+        git_oid_cpy(&entry->parents[i], git_commit_parent_id(commit, i));
+      entry->author = strdup(author->name);
+      entry->time = author->when.time;
+      entry->summary = strdup(summary ? summary : "");
+    }
+    git_commit_free(commit);
+  }
+  if (error == GIT_ITEROVER) {
+    log->done = 1;
+    error = 0;
+  }
+  return error;
+}
+
+// Packed as a flat array of id, parents, author, time, summary, id, ...; parents is the parent ids concatenated into a
+// single string. Once the history is exhausted, returns nil.
+static int git_repo_log_results(lua_State* L, operation_t* operation) {
+  log_operation_t* log = (log_operation_t*)operation;
+  if (log->count == 0 && log->done) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, log->count * 5, 0);
+  for (size_t i = 0; i < log->count; ++i) {
+    log_entry_t* entry = &log->entries[i];
+    lua_pushoid(L, &entry->id, log->binary);
+    lua_rawseti(L, -2, i * 5 + 1);
+    luaL_Buffer buffer;
+    luaL_buffinit(L, &buffer);
+    for (unsigned int j = 0; j < entry->parent_count; ++j) {
+      if (log->binary)
+        luaL_addlstring(&buffer, (const char*)entry->parents[j].id, GIT_OID_RAWSZ);
+      else {
+        hex_encode(luaL_prepbuffsize(&buffer, GIT_OID_HEXSZ), entry->parents[j].id, GIT_OID_RAWSZ);
+        luaL_addsize(&buffer, GIT_OID_HEXSZ);
+      }
+    }
+    luaL_pushresult(&buffer);
+    lua_rawseti(L, -2, i * 5 + 2);
+    lua_pushstring(L, entry->author);
+    lua_rawseti(L, -2, i * 5 + 3);
+    lua_pushinteger(L, entry->time);
+    lua_rawseti(L, -2, i * 5 + 4);
+    lua_pushstring(L, entry->summary);
+    lua_rawseti(L, -2, i * 5 + 5);
+  }
+  free_log_entries(log);
+  return 1;
+}
+
+// Reads the next batch of commits; from a coroutine, yields while the worker walks. Usable directly as a for iterator.
+static int f_git_log_next(lua_State* L) {
+  log_operation_t* log = luaL_checkudata(L, 1, API_GIT_LOG);
+  lock_mutex(pool.mutex);
+  int running = log->operation.worker && !log->operation.complete;
+  unlock_mutex(pool.mutex);
+  if (running)
+    return luaL_error(L, "git log error: a batch is already being read");
+  if (log->done) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_settop(L, 1);
+  return f_git_operation(L, log->worker, &log->operation);
+}
+
+static int f_git_log_gc(lua_State* L) {
+  log_operation_t* log = luaL_checkudata(L, 1, API_GIT_LOG);
+  free_log_entries(log);
+  free(log->entries);
+  if (log->walk)
+    git_revwalk_free(log->walk);
+  string_list_free(&log->starts);
+  string_list_free(&log->paths);
+  return 0;
+}
+
+// Takes an optional table of options: start (a revision, or table of them; default HEAD), sort ("time", the default,
+// "topo" or "none"), reverse, paths (a path or table of paths, files or directories, that commits must touch), and batch
+// (commits per batch, default 256). Returns an iterator which yields successive batches of commits; see
+// git_repo_log_results. Only unsorted and time-sorted walks can return their first batch without walking the whole history.
+static int f_git_repo_log(lua_State* L) {
+  worker_t* worker = luaL_checkworker(L, 1);
+  int has_options = lua_istable(L, 2);
+  log_operation_t* log = (log_operation_t*)lua_newoperation(L, sizeof(log_operation_t), "log", git_repo_log_callback);
+  int operation_index = lua_gettop(L);
+  luaL_setmetatable(L, API_GIT_LOG);
+  // Keeps the repository, and so the worker, alive for as long as the log is.
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, operation_index, 1);
+  log->operation.results = git_repo_log_results;
+  log->worker = worker;
+  log->binary = lua_isbinaryoids(L, 1);
+  log->sort = GIT_SORT_TIME;
+  log->batch_size = LOG_DEFAULT_BATCH_SIZE;
+  if (has_options) {
+    char hex[GIT_OID_HEXSZ + 1];
+    if (lua_getfield(L, 2, "start") == LUA_TTABLE) {
+      for (size_t i = 1, count = lua_rawlen(L, -1); i <= count; ++i) {
+        lua_rawgeti(L, -1, i);
+        const char* start = luaL_checkrevision(L, -1, hex);
+        string_list_push(&log->starts, start, strlen(start));
+        lua_pop(L, 1);
+      }
+    } else if (!lua_isnil(L, -1)) {
+      const char* start = luaL_checkrevision(L, -1, hex);
+      string_list_push(&log->starts, start, strlen(start));
+    }
+    lua_pop(L, 1);
+    git_strarray paths;
+    if (lua_getoptstrarray(L, 2, "paths", &paths)) {
+      for (size_t i = 0; i < paths.count; ++i) {
+        size_t length = strlen(paths.strings[i]);
+        while (length > 0 && paths.strings[i][length - 1] == '/')
+          --length;
+        if (length > 0)
+          string_list_push(&log->paths, paths.strings[i], length);
+      }
+      lua_pop(L, 2);
+    }
+    lua_getfield(L, 2, "sort");
+    const char* sort = luaL_optstring(L, -1, "time");
+    if (strcmp(sort, "time") == 0) log->sort = GIT_SORT_TIME;
+    else if (strcmp(sort, "topo") == 0) log->sort = GIT_SORT_TOPOLOGICAL;
+    else if (strcmp(sort, "none") == 0) log->sort = GIT_SORT_NONE;
+    else return luaL_error(L, "unknown log sort %s", sort);
+    lua_pop(L, 1);
+    if (lua_getoptboolean(L, 2, "reverse", 0))
+      log->sort |= GIT_SORT_REVERSE;
+    lua_getfield(L, 2, "batch");
+    lua_Integer batch_size = luaL_optinteger(L, -1, LOG_DEFAULT_BATCH_SIZE);
+    lua_pop(L, 1);
+    if (batch_size < 1)
+      return luaL_error(L, "log batch size must be positive");
+    log->batch_size = batch_size;
+  }
+  log->entries = malloc(sizeof(log_entry_t) * log->batch_size);
+  return 1;
+}
+
+// A diff's sides are each a tree (any revision), the index, or the working directory.
+#define DIFF_TREE 0
+#define DIFF_INDEX 1
+#define DIFF_WORKDIR 2
+#define DIFF_DEFAULT_BATCH_SIZE 256
+
+// Like a log, a diff is an operation that lives on as an iterator. The deltas are all computed by the worker in one go,
+// but only held in C; each batch is then read straight out of them on the lua thread, as nothing else touches a
+// finished diff.
+typedef struct {
+  operation_t operation;
+  worker_t* worker;
+  char* from;
+  char* to;
+  int from_kind;
+  int to_kind;
+  git_diff_options options;
+  string_list_t paths;
+  int find;
+  git_diff_find_options find_options;
+  git_diff* diff;
+  size_t next;
+  size_t batch_size;
+} diff_operation_t;
+
+static int diff_lookup_tree(git_tree** tree, git_repository* repository, const char* revision) {
+  git_object* object;
+  if (git_revparse_single(&object, repository, revision))
+    return -1;
+  int error = git_object_peel((git_object**)tree, object, GIT_OBJECT_TREE);
+  git_object_free(object);
+  return error;
+}
+
+static int git_repo_diff_callback(worker_t* worker, operation_t* operation) {
+  diff_operation_t* diff = (diff_operation_t*)operation;
+  git_tree *from = NULL, *to = NULL;
+  int error = 0;
+  if (diff->from_kind == DIFF_TREE)
+    error = diff_lookup_tree(&from, worker->repository, diff->from);
+  if (!error && diff->to_kind == DIFF_TREE)
+    error = diff_lookup_tree(&to, worker->repository, diff->to);
+  if (!error) {
+    if (diff->from_kind == DIFF_INDEX && diff->to_kind == DIFF_WORKDIR)
+      error = git_diff_index_to_workdir(&diff->diff, worker->repository, NULL, &diff->options);
+    else if (diff->to_kind == DIFF_WORKDIR)
+      error = git_diff_tree_to_workdir_with_index(&diff->diff, worker->repository, from, &diff->options);
+    else if (diff->to_kind == DIFF_INDEX)
+      error = git_diff_tree_to_index(&diff->diff, worker->repository, from, NULL, &diff->options);
+    else if (diff->from_kind == DIFF_INDEX) {
+      // Index to tree, as the reverse of tree to index.
+      diff->options.flags |= GIT_DIFF_REVERSE;
+      error = git_diff_tree_to_index(&diff->diff, worker->repository, to, NULL, &diff->options);
+    } else
+      error = git_diff_tree_to_tree(&diff->diff, worker->repository, from, to, &diff->options);
+  }
+  git_tree_free(from);
+  git_tree_free(to);
+  if (!error && diff->find)
+    error = git_diff_find_similar(diff->diff, &diff->find_options);
+  if (error && diff->diff) {
+    git_diff_free(diff->diff);
+    diff->diff = NULL;
+  }
+  return error;
+}
+
+// Packed as a flat array of status, old_path, new_path, similarity, status, ...; status is the letter git diff
+// --name-status would show, and similarity is only non-zero for renames and copies. Once every delta has been read,
+// returns nil.
+static int git_repo_diff_results(lua_State* L, operation_t* operation) {
+  diff_operation_t* diff = (diff_operation_t*)operation;
+  size_t total = git_diff_num_deltas(diff->diff);
+  if (diff->next >= total) {
+    lua_pushnil(L);
+    return 1;
+  }
+  size_t count = total - diff->next < diff->batch_size ? total - diff->next : diff->batch_size;
+  lua_createtable(L, count * 4, 0);
+  for (size_t i = 0; i < count; ++i) {
+    const git_diff_delta* delta = git_diff_get_delta(diff->diff, diff->next + i);
+    char status = git_diff_status_char(delta->status);
+    lua_pushlstring(L, &status, 1);
+    lua_rawseti(L, -2, i * 4 + 1);
+    lua_pushstring(L, delta->old_file.path);
+    lua_rawseti(L, -2, i * 4 + 2);
+    lua_pushstring(L, delta->new_file.path);
+    lua_rawseti(L, -2, i * 4 + 3);
+    lua_pushinteger(L, delta->similarity);
+    lua_rawseti(L, -2, i * 4 + 4);
+  }
+  diff->next += count;
+  return 1;
+}
+
+// Reads the next batch of deltas. Only the first has to wait on the worker, yielding if called from a coroutine; the
+// rest come straight from the finished diff. Usable directly as a for iterator.
+static int f_git_diff_next(lua_State* L) {
+  diff_operation_t* diff = luaL_checkudata(L, 1, API_GIT_DIFF);
+  lock_mutex(pool.mutex);
+  int running = diff->operation.worker && !diff->operation.complete;
+  unlock_mutex(pool.mutex);
+  if (running)
+    return luaL_error(L, "git diff error: a batch is already being read");
+  lua_settop(L, 1);
+  if (diff->diff)
+    return git_repo_diff_results(L, &diff->operation);
+  return f_git_operation(L, diff->worker, &diff->operation);
+}
+
+static int f_git_diff_gc(lua_State* L) {
+  diff_operation_t* diff = luaL_checkudata(L, 1, API_GIT_DIFF);
+  if (diff->diff)
+    git_diff_free(diff->diff);
+  free(diff->from);
+  free(diff->to);
+  string_list_free(&diff->paths);
+  return 0;
+}
+
+static int luaL_checkdiffside(lua_State* L, int idx, char** revision) {
+  char hex[GIT_OID_HEXSZ + 1];
+  const char* name = luaL_checkrevision(L, idx, hex);
+  if (strcmp(name, "index") == 0)
+    return DIFF_INDEX;
+  if (strcmp(name, "workdir") == 0)
+    return DIFF_WORKDIR;
+  *revision = strdup(name);
+  return DIFF_TREE;
+}
+
+// Diffs from one side to another, each a revision, or "index" or "workdir" (for a branch with either name, use its full
+// reference name); the working directory can only be diffed to, and only from a revision or the index. Takes an
+// optional table of options: paths (a pathspec), untracked (include untracked files in a working directory diff),
+// renames and copies (detect them, the latter among changed files only), similarity (the percentage for a rename or copy,
+// default 50), rename_limit, and batch (deltas per batch, default 256). Returns an iterator which yields successive
+// batches of deltas; see git_repo_diff_results.
+static int f_git_repo_diff(lua_State* L) {
+  worker_t* worker = luaL_checkworker(L, 1);
+  int has_options = lua_istable(L, 4);
+  diff_operation_t* diff = (diff_operation_t*)lua_newoperation(L, sizeof(diff_operation_t), "diff", git_repo_diff_callback);
+  int operation_index = lua_gettop(L);
+  luaL_setmetatable(L, API_GIT_DIFF);
+  // Keeps the repository, and so the worker, alive for as long as the diff is.
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, operation_index, 1);
+  diff->operation.results = git_repo_diff_results;
+  diff->worker = worker;
+  diff->batch_size = DIFF_DEFAULT_BATCH_SIZE;
+  git_diff_options_init(&diff->options, GIT_DIFF_OPTIONS_VERSION);
+  git_diff_find_options_init(&diff->find_options, GIT_DIFF_FIND_OPTIONS_VERSION);
+  diff->from_kind = luaL_checkdiffside(L, 2, &diff->from);
+  diff->to_kind = luaL_checkdiffside(L, 3, &diff->to);
+  if (diff->from_kind == DIFF_WORKDIR || (diff->from_kind == DIFF_INDEX && diff->to_kind == DIFF_INDEX))
+    return luaL_error(L, "can't diff from the %s to the %s", lua_tostring(L, 2), lua_tostring(L, 3));
+  if (has_options) {
+    git_strarray paths;
+    if (lua_getoptstrarray(L, 4, "paths", &paths)) {
+      // Copied, as the diff is only run on the first read.
+      for (size_t i = 0; i < paths.count; ++i)
+        string_list_push(&diff->paths, paths.strings[i], strlen(paths.strings[i]));
+      diff->options.pathspec.strings = diff->paths.strings;
+      diff->options.pathspec.count = diff->paths.count;
+      lua_pop(L, 2);
+    }
+    if (lua_getoptboolean(L, 4, "untracked", 0))
+      diff->options.flags |= GIT_DIFF_INCLUDE_UNTRACKED | GIT_DIFF_RECURSE_UNTRACKED_DIRS;
+    if (lua_getoptboolean(L, 4, "renames", 0))
+      diff->find_options.flags |= GIT_DIFF_FIND_RENAMES | (diff->options.flags & GIT_DIFF_INCLUDE_UNTRACKED ? GIT_DIFF_FIND_FOR_UNTRACKED : 0);
+    if (lua_getoptboolean(L, 4, "copies", 0))
+      diff->find_options.flags |= GIT_DIFF_FIND_COPIES;
+    lua_Integer value;
+    if (lua_getoptinteger(L, 4, "similarity", &value)) {
+      if (value < 0 || value > 100)
+        return luaL_error(L, "diff similarity must be a percentage");
+      diff->find_options.rename_threshold = diff->find_options.copy_threshold = value;
+    }
+    if (lua_getoptinteger(L, 4, "rename_limit", &value))
+      diff->find_options.rename_limit = value;
+    if (lua_getoptinteger(L, 4, "batch", &value)) {
+      if (value < 1)
+        return luaL_error(L, "diff batch size must be positive");
+      diff->batch_size = value;
+    }
+    diff->find = diff->find_options.flags != 0;
+  }
+  return 1;
+}
+
+// Writes a commit-graph covering everything reachable from any reference, and turns on core.commitGraph so that it's
+// read whenever the repository is opened. Walks, merge bases and ahead/behind counts then take parents and generation
+// numbers from the memory-mapped graph rather than inflating each commit. The worker's own handle has already loaded its
+// object database, so the new graph is handed to it directly.
+static int git_repo_commit_graph_callback(worker_t* worker, operation_t* operation) {
+  git_buf objects_dir = { 0 };
+  char info_dir[4096];
+  git_revwalk* walk = NULL;
+  git_commit_graph_writer* writer = NULL;
+  git_commit_graph_writer_options options = GIT_COMMIT_GRAPH_WRITER_OPTIONS_INIT;
+  git_commit_graph* graph = NULL;
+  git_config* config = NULL;
+  git_odb* odb = NULL;
+  int error = git_repository_item_path(&objects_dir, worker->repository, GIT_REPOSITORY_ITEM_OBJECTS);
+  if (!error) {
+    snprintf(info_dir, sizeof(info_dir), "%sinfo", objects_dir.ptr);
+    error = git_revwalk_new(&walk, worker->repository);
+  }
+  if (!error)
+    error = git_revwalk_push_glob(walk, "*");
+  // A detached or unborn HEAD is fine either way.
+  if (!error)
+    git_revwalk_push_head(walk);
+  if (!error)
+    error = git_commit_graph_writer_new(&writer, info_dir);
+  if (!error)
+    error = git_commit_graph_writer_add_revwalk(writer, walk);
+  if (!error)
+    error = git_commit_graph_writer_commit(writer, &options);
+  if (!error)
+    error = git_repository_config(&config, worker->repository);
+  if (!error)
+    error = git_config_set_bool(config, "core.commitGraph", 1);
+  if (!error)
+    error = git_repository_odb(&odb, worker->repository);
+  if (!error)
+    error = git_commit_graph_open(&graph, objects_dir.ptr);
+  // The object database takes ownership of the graph.
+  if (!error)
+    error = git_odb_set_commit_graph(odb, graph);
+  if (odb)
+    git_odb_free(odb);
+  if (config)
+    git_config_free(config);
+  if (writer)
+    git_commit_graph_writer_free(writer);
+  if (walk)
+    git_revwalk_free(walk);
+  git_buf_dispose(&objects_dir);
+  return error;
+}
+
+static int f_git_repo_commit_graph(lua_State* L) {
+  worker_t* worker = luaL_checkworker(L, 1);
+  operation_t* operation = lua_newoperation(L, sizeof(operation_t), "commit graph", git_repo_commit_graph_callback);
+  return f_git_operation(L, worker, operation);
+}
+
+// Ahead/behind counts for every local branch against its upstream, in one walk. Each distinct branch tip gets a bit, and
+// commits are visited children first, each passing its bits on to its parents, so that every commit ends up marked with
+// the set of tips it's reachable from; a branch is ahead by the commits that carry its bit but not its upstream's, and
+// behind by the reverse. The walk stops once everything left to visit is reachable from every tip, as then it can't
+// contribute to any count.
+//
+// As in git, commits are ordered by generation number, and only then by commit time; a commit's generation is always
+// greater than its parents', whereas its time can be behind theirs if clocks were skewed, which would visit a parent
+// before all of its bits had arrived. Generations come from the commit-graph, if there is one, along with each
+// commit's time and parents, so that commits it covers needn't be loaded at all. Commits it doesn't cover (and all
+// commits, without one) are looked up as usual, and count as infinitely far from the roots, falling back to time.
+#define GENERATION_INFINITY 0xFFFFFFFF
+#define COMMIT_GRAPH_MISSING 0xFFFFFFFF
+#define COMMIT_GRAPH_NO_PARENT 0x70000000
+#define COMMIT_GRAPH_OCTOPUS 0x80000000
+#define COMMIT_GRAPH_DATA_SIZE (GIT_OID_RAWSZ + 16)
+
+typedef struct {
+  git_oid id;
+  // Only for commits outside the graph, from when they're queued until they're visited.
+  git_commit* commit;
+  uint32_t position;
+  uint32_t generation;
+  git_time_t time;
+  int queued;
+  int seen;
+  uint64_t bits[];
+} ahead_behind_node_t;
+
+// The graph file is mapped, and its chunks read in place.
+typedef struct {
+  unsigned char* data;
+  size_t size;
+  const unsigned char* fanout;
+  const unsigned char* oids;
+  const unsigned char* commits;
+  const unsigned char* edges;
+  size_t edge_count;
+  uint32_t count;
+} commit_graph_file_t;
+
+typedef struct {
+  commit_graph_file_t graph;
+  ahead_behind_node_t** nodes;
+  size_t capacity;
+  size_t count;
+  ahead_behind_node_t** heap;
+  size_t heap_count;
+  size_t heap_capacity;
+  size_t words;
+} ahead_behind_walk_t;
+
+typedef struct {
+  char* branch;
+  char* upstream;
+  size_t local;
+  size_t remote;
+  size_t ahead;
+  size_t behind;
+} ahead_behind_t;
+
+typedef struct {
+  operation_t operation;
+  ahead_behind_t* branches;
+  size_t count;
+} ahead_behind_operation_t;
+
+static size_t ahead_behind_hash(const git_oid* id) {
+  size_t hash;
+  memcpy(&hash, id->id, sizeof(hash));
+  return hash;
+}
+
+static ahead_behind_node_t* ahead_behind_node(ahead_behind_walk_t* walk, const git_oid* id) {
+  if (walk->count * 2 >= walk->capacity) {
+    size_t capacity = walk->capacity ? walk->capacity * 2 : 1024;
+    ahead_behind_node_t** nodes = calloc(capacity, sizeof(ahead_behind_node_t*));
+    for (size_t i = 0; i < walk->capacity; ++i) {
+      if (walk->nodes[i]) {
+        size_t j = ahead_behind_hash(&walk->nodes[i]->id) & (capacity - 1);
+        while (nodes[j])
+          j = (j + 1) & (capacity - 1);
+        nodes[j] = walk->nodes[i];
+      }
+    }
+    free(walk->nodes);
+    walk->nodes = nodes;
+    walk->capacity = capacity;
+  }
+  size_t i = ahead_behind_hash(id) & (walk->capacity - 1);
+  while (walk->nodes[i]) {
+    if (git_oid_equal(&walk->nodes[i]->id, id))
+      return walk->nodes[i];
+    i = (i + 1) & (walk->capacity - 1);
+  }
+  ahead_behind_node_t* node = calloc(1, sizeof(ahead_behind_node_t) + sizeof(uint64_t) * walk->words);
+  git_oid_cpy(&node->id, id);
+  walk->nodes[i] = node;
+  ++walk->count;
+  return node;
+}
+
+static uint32_t read_be32(const unsigned char* bytes) {
+  return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static unsigned char* map_file(const char* path, size_t* size) {
+  unsigned char* data = NULL;
+  #if _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+      return NULL;
+    LARGE_INTEGER length;
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+      HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (mapping) {
+        data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        *size = length.QuadPart;
+      }
+    }
+    CloseHandle(file);
+  #else
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+      return NULL;
+    struct stat st;
+    if (!fstat(fd, &st) && st.st_size > 0) {
+      data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED)
+        data = NULL;
+      *size = st.st_size;
+    }
+    close(fd);
+  #endif
+  return data;
+}
+
+static void unmap_file(unsigned char* data, size_t size) {
+  #if _WIN32
+    UnmapViewOfFile(data);
+  #else
+    munmap(data, size);
+  #endif
+}
+
+// Maps objects/info/commit-graph, as written by repo:commit_graph; a missing or unrecognised graph is simply not used.
+// Only that single SHA-1 graph is read: split graphs, in a commit-graphs chain, are ignored, and their commits looked up
+// as though there were no graph.
+static void commit_graph_open(commit_graph_file_t* graph, git_repository* repository) {
+  git_buf objects_dir = { 0 };
+  char path[4096];
+  memset(graph, 0, sizeof(commit_graph_file_t));
+  if (git_repository_item_path(&objects_dir, repository, GIT_REPOSITORY_ITEM_OBJECTS))
+    return;
+  snprintf(path, sizeof(path), "%sinfo/commit-graph", objects_dir.ptr);
+  git_buf_dispose(&objects_dir);
+  if (!(graph->data = map_file(path, &graph->size)))
+    return;
+  const unsigned char* data = graph->data;
+  size_t edges_size = 0;
+  if (graph->size >= 8 && memcmp(data, "CGPH", 4) == 0 && data[4] == 1 && data[5] == 1 && 8 + (size_t)(data[6] + 1) * 12 <= graph->size) {
+    // Each chunk runs up to the start of the next; the table ends with an entry giving the end of the last.
+    for (int i = 0; i < data[6]; ++i) {
+      const unsigned char* chunk = &data[8 + i * 12];
+      uint64_t offset = ((uint64_t)read_be32(&chunk[4]) << 32) | read_be32(&chunk[8]);
+      uint64_t next = ((uint64_t)read_be32(&chunk[16]) << 32) | read_be32(&chunk[20]);
+      if (offset > next || next > graph->size)
+        break;
+      if (memcmp(chunk, "OIDF", 4) == 0 && next - offset >= 256 * 4) graph->fanout = &data[offset];
+      else if (memcmp(chunk, "OIDL", 4) == 0) graph->oids = &data[offset];
+      else if (memcmp(chunk, "CDAT", 4) == 0) graph->commits = &data[offset];
+      else if (memcmp(chunk, "EDGE", 4) == 0) {
+        graph->edges = &data[offset];
+        edges_size = next - offset;
+      }
+    }
+  }
+  if (graph->fanout && graph->oids && graph->commits) {
+    graph->count = read_be32(&graph->fanout[255 * 4]);
+    graph->edge_count = edges_size / 4;
+    size_t end = graph->size - 20;
+    if ((size_t)(graph->oids - data) + (size_t)graph->count * GIT_OID_RAWSZ <= end && (size_t)(graph->commits - data) + (size_t)graph->count * COMMIT_GRAPH_DATA_SIZE <= end)
+      return;
+  }
+  unmap_file(graph->data, graph->size);
+  graph->data = NULL;
+}
+
+static void commit_graph_close(commit_graph_file_t* graph) {
+  if (graph->data)
+    unmap_file(graph->data, graph->size);
+  graph->data = NULL;
+}
+
+static uint32_t commit_graph_find(commit_graph_file_t* graph, const git_oid* id) {
+  if (!graph->data)
+    return COMMIT_GRAPH_MISSING;
+  uint32_t low = id->id[0] ? read_be32(&graph->fanout[(id->id[0] - 1) * 4]) : 0, high = read_be32(&graph->fanout[id->id[0] * 4]);
+  if (high > graph->count)
+    return COMMIT_GRAPH_MISSING;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    int comparison = memcmp(&graph->oids[(size_t)middle * GIT_OID_RAWSZ], id->id, GIT_OID_RAWSZ);
+    if (comparison == 0)
+      return middle;
+    if (comparison < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return COMMIT_GRAPH_MISSING;
+}
+
+// Each commit's data is its tree, its first two parents' positions, then the generation in the top 30 bits of the last
+// eight bytes, and the commit time in the rest. A second parent with the top bit set is instead an index into the
+// extra edges, which list the second parent onwards, the last with its top bit set.
+static const unsigned char* commit_graph_data(commit_graph_file_t* graph, uint32_t position) {
+  return &graph->commits[(size_t)position * COMMIT_GRAPH_DATA_SIZE];
+}
+
+static unsigned int commit_graph_parent_count(commit_graph_file_t* graph, uint32_t position) {
+  const unsigned char* data = commit_graph_data(graph, position);
+  uint32_t first = read_be32(&data[GIT_OID_RAWSZ]), second = read_be32(&data[GIT_OID_RAWSZ + 4]);
+  if (first == COMMIT_GRAPH_NO_PARENT)
+    return 0;
+  if (second == COMMIT_GRAPH_NO_PARENT)
+    return 1;
+  if (!(second & COMMIT_GRAPH_OCTOPUS))
+    return 2;
+  unsigned int count = 1;
+  for (size_t edge = second & ~COMMIT_GRAPH_OCTOPUS; edge < graph->edge_count; ++edge) {
+    ++count;
+    if (read_be32(&graph->edges[edge * 4]) & COMMIT_GRAPH_OCTOPUS)
+      break;
+  }
+  return count;
+}
+
+// Returns -1 on a parent that's outside the graph, which only a corrupt graph would have.
+static int commit_graph_parent(commit_graph_file_t* graph, uint32_t position, unsigned int i, git_oid* id) {
+  const unsigned char* data = commit_graph_data(graph, position);
+  uint32_t second = read_be32(&data[GIT_OID_RAWSZ + 4]);
+  uint32_t parent;
+  if (i == 0)
+    parent = read_be32(&data[GIT_OID_RAWSZ]);
+  else if (!(second & COMMIT_GRAPH_OCTOPUS))
+    parent = second;
+  else
+    parent = read_be32(&graph->edges[((second & ~COMMIT_GRAPH_OCTOPUS) + i - 1) * 4]) & ~COMMIT_GRAPH_OCTOPUS;
+  if (parent >= graph->count) {
+    git_error_set_str(GIT_ERROR_ODB, "corrupt commit-graph");
+    return -1;
+  }
+  git_oid_fromraw(id, &graph->oids[(size_t)parent * GIT_OID_RAWSZ]);
+  return 0;
+}
+
+static int ahead_behind_newer(ahead_behind_node_t* a, ahead_behind_node_t* b) {
+  if (a->generation != b->generation)
+    return a->generation > b->generation;
+  return a->time > b->time;
+}
+
+static int ahead_behind_push(ahead_behind_walk_t* walk, git_repository* repository, ahead_behind_node_t* node) {
+  node->position = commit_graph_find(&walk->graph, &node->id);
+  if (node->position != COMMIT_GRAPH_MISSING) {
+    const unsigned char* data = commit_graph_data(&walk->graph, node->position);
+    uint32_t high = read_be32(&data[GIT_OID_RAWSZ + 8]), low = read_be32(&data[GIT_OID_RAWSZ + 12]);
+    // Zero is a graph written without generations.
+    node->generation = high >> 2 ? high >> 2 : GENERATION_INFINITY;
+    node->time = ((git_time_t)(high & 3) << 32) | low;
+  } else {
+    if (git_commit_lookup(&node->commit, repository, &node->id))
+      return -1;
+    node->generation = GENERATION_INFINITY;
+    node->time = git_commit_time(node->commit);
+  }
+  node->queued = 1;
+  node->seen = 1;
+  if (walk->heap_count == walk->heap_capacity) {
+    walk->heap_capacity = walk->heap_capacity ? walk->heap_capacity * 2 : 256;
+    walk->heap = realloc(walk->heap, sizeof(ahead_behind_node_t*) * walk->heap_capacity);
+  }
+  size_t i = walk->heap_count++;
+  for (; i > 0 && ahead_behind_newer(node, walk->heap[(i - 1) / 2]); i = (i - 1) / 2)
+    walk->heap[i] = walk->heap[(i - 1) / 2];
+  walk->heap[i] = node;
+  return 0;
+}
+
+static ahead_behind_node_t* ahead_behind_pop(ahead_behind_walk_t* walk) {
+  ahead_behind_node_t* top = walk->heap[0];
+  ahead_behind_node_t* last = walk->heap[--walk->heap_count];
+  size_t i = 0;
+  while (i * 2 + 1 < walk->heap_count) {
+    size_t child = i * 2 + 1;
+    if (child + 1 < walk->heap_count && ahead_behind_newer(walk->heap[child + 1], walk->heap[child]))
+      ++child;
+    if (!ahead_behind_newer(walk->heap[child], last))
+      break;
+    walk->heap[i] = walk->heap[child];
+    i = child;
+  }
+  if (walk->heap_count)
+    walk->heap[i] = last;
+  top->queued = 0;
+  return top;
+}
+
+static int ahead_behind_full(ahead_behind_walk_t* walk, const uint64_t* bits, size_t tips) {
+  for (size_t i = 0; i < walk->words; ++i) {
+    uint64_t full = (i + 1) * 64 <= tips ? ~(uint64_t)0 : (((uint64_t)1 << (tips % 64)) - 1);
+    if (bits[i] != full)
+      return 0;
+  }
+  return 1;
+}
+
+static int ahead_behind_has(const uint64_t* bits, size_t tip) {
+  return (bits[tip / 64] >> (tip % 64)) & 1;
+}
+
+static void free_ahead_behind_walk(ahead_behind_walk_t* walk) {
+  for (size_t i = 0; i < walk->capacity; ++i) {
+    if (walk->nodes[i]) {
+      if (walk->nodes[i]->queued)
+        git_commit_free(walk->nodes[i]->commit);
+      free(walk->nodes[i]);
+    }
+  }
+  free(walk->nodes);
+  free(walk->heap);
+  commit_graph_close(&walk->graph);
+}
+
+static void free_ahead_behind(ahead_behind_operation_t* ahead_behind) {
+  for (size_t i = 0; i < ahead_behind->count; ++i) {
+    free(ahead_behind->branches[i].branch);
+    free(ahead_behind->branches[i].upstream);
+  }
+  free(ahead_behind->branches);
+  ahead_behind->branches = NULL;
+  ahead_behind->count = 0;
+}
+
+// Collects each local branch with an upstream, and the distinct tips between them.
+static int ahead_behind_branches(git_repository* repository, ahead_behind_operation_t* ahead_behind, git_oid** tips, size_t* tip_count) {
+  git_branch_iterator* iterator;
+  git_reference* reference;
+  git_branch_t type;
+  size_t capacity = 0;
+  int error;
+  if (git_branch_iterator_new(&iterator, repository, GIT_BRANCH_LOCAL))
+    return -1;
+  while (!(error = git_branch_next(&reference, &type, iterator))) {
+    git_reference* upstream;
+    const char *branch_name, *upstream_name;
+    if (!git_reference_target(reference) || git_branch_upstream(&upstream, reference)) {
+      git_reference_free(reference);
+      continue;
+    }
+    if (git_reference_target(upstream) && !git_branch_name(&branch_name, reference) && !git_branch_name(&upstream_name, upstream)) {
+      if (ahead_behind->count == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        ahead_behind->branches = realloc(ahead_behind->branches, sizeof(ahead_behind_t) * capacity);
+        *tips = realloc(*tips, sizeof(git_oid) * capacity * 2);
+      }
+      ahead_behind_t* branch = &ahead_behind->branches[ahead_behind->count++];
+      memset(branch, 0, sizeof(ahead_behind_t));
+      branch->branch = strdup(branch_name);
+      branch->upstream = strdup(upstream_name);
+      const git_oid* targets[] = { git_reference_target(reference), git_reference_target(upstream) };
+      size_t* indices[] = { &branch->local, &branch->remote };
+      for (int i = 0; i < 2; ++i) {
+        size_t j = 0;
+        while (j < *tip_count && !git_oid_equal(&(*tips)[j], targets[i]))
+          ++j;
+        if (j == *tip_count)
+          git_oid_cpy(&(*tips)[(*tip_count)++], targets[i]);
+        *indices[i] = j;
+      }
+    }
+    git_reference_free(upstream);
+    git_reference_free(reference);
+  }
+  git_branch_iterator_free(iterator);
+  return error == GIT_ITEROVER ? 0 : error;
+}
+
+static int git_repo_ahead_behind_callback(worker_t* worker, operation_t* operation) {
+  ahead_behind_operation_t* ahead_behind = (ahead_behind_operation_t*)operation;
+  git_oid* tips = NULL;
+  size_t tip_count = 0;
+  if (ahead_behind_branches(worker->repository, ahead_behind, &tips, &tip_count)) {
+    free(tips);
+    free_ahead_behind(ahead_behind);
+    return -1;
+  }
+  ahead_behind_walk_t walk = { 0 };
+  walk.words = (tip_count + 63) / 64;
+  commit_graph_open(&walk.graph, worker->repository);
+  // The number of queued commits not yet reachable from every tip; once there are none, we're done.
+  size_t unsettled = 0;
+  int error = 0;
+  for (size_t i = 0; i < tip_count; ++i) {
+    ahead_behind_node_t* node = ahead_behind_node(&walk, &tips[i]);
+    node->bits[i / 64] |= (uint64_t)1 << (i % 64);
+  }
+  for (size_t i = 0; i < tip_count && !error; ++i) {
+    ahead_behind_node_t* node = ahead_behind_node(&walk, &tips[i]);
+    if (!node->seen) {
+      error = ahead_behind_push(&walk, worker->repository, node);
+      if (!ahead_behind_full(&walk, node->bits, tip_count))
+        ++unsettled;
+    }
+  }
+  while (!error && unsettled > 0 && walk.heap_count > 0) {
+    ahead_behind_node_t* node = ahead_behind_pop(&walk);
+    if (!ahead_behind_full(&walk, node->bits, tip_count)) {
+      --unsettled;
+      for (size_t i = 0; i < ahead_behind->count; ++i) {
+        ahead_behind_t* branch = &ahead_behind->branches[i];
+        int local = ahead_behind_has(node->bits, branch->local), remote = ahead_behind_has(node->bits, branch->remote);
+        if (local && !remote)
+          ++branch->ahead;
+        else if (remote && !local)
+          ++branch->behind;
+      }
+    }
+    unsigned int parent_count = node->commit ? git_commit_parentcount(node->commit) : commit_graph_parent_count(&walk.graph, node->position);
+    for (unsigned int i = 0; i < parent_count && !error; ++i) {
+      git_oid parent_id;
+      if (node->commit)
+        git_oid_cpy(&parent_id, git_commit_parent_id(node->commit, i));
+      else if ((error = commit_graph_parent(&walk.graph, node->position, i, &parent_id)))
+        break;
+      ahead_behind_node_t* parent = ahead_behind_node(&walk, &parent_id);
+      int was_full = ahead_behind_full(&walk, parent->bits, tip_count);
+      for (size_t j = 0; j < walk.words; ++j)
+        parent->bits[j] |= node->bits[j];
+      int is_full = ahead_behind_full(&walk, parent->bits, tip_count);
+      if (!parent->seen) {
+        error = ahead_behind_push(&walk, worker->repository, parent);
+        if (!is_full)
+          ++unsettled;
+      } else if (parent->queued && !was_full && is_full)
+        --unsettled;
+    }
+    git_commit_free(node->commit);
+    node->commit = NULL;
+  }
+  free_ahead_behind_walk(&walk);
+  free(tips);
+  if (error)
+    free_ahead_behind(ahead_behind);
+  return error;
+}
+
+// Packed as a flat array of branch, upstream, ahead, behind, branch, ...; branches without an upstream are left out.
+static int git_repo_ahead_behind_results(lua_State* L, operation_t* operation) {
+  ahead_behind_operation_t* ahead_behind = (ahead_behind_operation_t*)operation;
+  lua_createtable(L, ahead_behind->count * 4, 0);
+  for (size_t i = 0; i < ahead_behind->count; ++i) {
+    lua_pushstring(L, ahead_behind->branches[i].branch);
+    lua_rawseti(L, -2, i * 4 + 1);
+    lua_pushstring(L, ahead_behind->branches[i].upstream);
+    lua_rawseti(L, -2, i * 4 + 2);
+    lua_pushinteger(L, ahead_behind->branches[i].ahead);
+    lua_rawseti(L, -2, i * 4 + 3);
+    lua_pushinteger(L, ahead_behind->branches[i].behind);
+    lua_rawseti(L, -2, i * 4 + 4);
+  }
+  free_ahead_behind(ahead_behind);
+  return 1;
+}
+
+static int f_git_repo_ahead_behind_all(lua_State* L) {
+  worker_t* worker = luaL_checkworker(L, 1);
+  ahead_behind_operation_t* ahead_behind = (ahead_behind_operation_t*)lua_newoperation(L, sizeof(ahead_behind_operation_t), "ahead behind", git_repo_ahead_behind_callback);
+  ahead_behind->operation.results = git_repo_ahead_behind_results;
+  return f_git_operation(L, worker, &ahead_behind->operation);
+}
+
+typedef struct {
+  operation_t operation;
+  worker_t* worker;
+  const char* url;
+  const char* path;
+  char* branch;
+  int single_branch;
+  int depth;
+} clone_operation_t;
+
+static int clone_remote_callback(git_remote** out, git_repository* repository, const char* name, const char* url, void* payload) {
+  clone_operation_t* clone = payload;
+  char refspec[1024];
+  snprintf(refspec, sizeof(refspec), "+refs/heads/%s:refs/remotes/%s/%s", clone->branch, name, clone->branch);
+  return git_remote_create_with_fetchspec(out, repository, name, url, refspec);
+}
+
+// Asks the remote which branch its HEAD points at, for single-branch clones that didn't name one.
+static int clone_default_branch(clone_operation_t* clone) {
+  git_remote* remote;
+  git_remote_callbacks callbacks = GIT_REMOTE_CALLBACKS_INIT;
+  git_buf buffer = { 0 };
+  callbacks.credentials = credential_callback;
+  callbacks.payload = &clone->operation;
+  if (git_remote_create_detached(&remote, clone->url))
+    return -1;
+  int error = git_remote_connect(remote, GIT_DIRECTION_FETCH, &callbacks, NULL, NULL);
+  if (!error)
+    error = git_remote_default_branch(&buffer, remote);
+  if (!error)
+    clone->branch = strdup(strncmp(buffer.ptr, "refs/heads/", 11) == 0 ? buffer.ptr + 11 : buffer.ptr);
+  git_buf_dispose(&buffer);
+  git_remote_disconnect(remote);
+  git_remote_free(remote);
+  return error;
+}
+
+// The clone becomes the worker's repository, so that the repository object handed back to lua starts with a warm worker.
+static int git_clone_callback(worker_t* worker, operation_t* operation) {
+  clone_operation_t* clone = (clone_operation_t*)operation;
+  git_clone_options clone_opts = GIT_CLONE_OPTIONS_INIT;
+  if (clone->single_branch && !clone->branch && clone_default_branch(clone))
+    return -1;
+  clone_opts.checkout_branch = clone->branch;
+  if (clone->single_branch) {
+    clone_opts.remote_cb = clone_remote_callback;
+    clone_opts.remote_cb_payload = clone;
+  }
+  clone_opts.fetch_opts.callbacks.credentials = credential_callback;
+  clone_opts.fetch_opts.callbacks.transfer_progress = transfer_progress_callback;
+  clone_opts.fetch_opts.callbacks.sideband_progress = sideband_progress_callback;
+  clone_opts.fetch_opts.callbacks.payload = operation;
+  #if LIBGIT2_VER_MAJOR > 1 || LIBGIT2_VER_MINOR >= 7
+    clone_opts.fetch_opts.depth = clone->depth;
+  #endif
+  clone_opts.checkout_opts.checkout_strategy = GIT_CHECKOUT_SAFE;
+  clone_opts.checkout_opts.progress_cb = checkout_progress_callback;
+  clone_opts.checkout_opts.progress_payload = operation;
+  if (git_clone(&worker->repository, clone->url, clone->path, &clone_opts))
+    return -1;
+  // The worker was created before there was a repository to ask; like every other worker, its path has to be the gitdir,
+  // as that's what paths like its index and MERGE_HEAD are built from.
+  free(worker->path);
+  worker->path = strdup(git_repository_path(worker->repository));
+  return 0;
+}
+
+static int git_clone_results(lua_State* L, operation_t* operation) {
+  clone_operation_t* clone = (clone_operation_t*)operation;
+  git_repository* repository;
+  if (git_repository_open(&repository, clone->path))
+    return luaL_error(L, "git clone error: %s", git_error_last_string());
+  lua_pushrepository(L, repository, lua_istable(L, 4) ? 4 : 0);
+  lua_pushlightuserdata(L, clone->worker);
+  lua_setfield(L, -2, "worker");
+  clone->worker = NULL;
+  return 1;
+}
+
+// Only reached once the clone is complete; if it failed, no repository took over its worker.
+static int f_git_clone_gc(lua_State* L) {
+  clone_operation_t* clone = lua_touserdata(L, 1);
+  if (clone->worker)
+    close_worker(clone->worker);
+  free(clone->branch);
+  return 0;
+}
+
+// Takes an optional table of options: branch (checked out instead of the remote's HEAD), single_branch (only fetch that
+// branch), depth (a shallow clone of that many commits; needs libgit2 1.7), credentials and progress. Returns the
+// cloned repository.
+static int f_git_clone(lua_State* L) {
+  const char* url = luaL_checkstring(L, 1);
+  const char* path = luaL_checkstring(L, 2);
+  // Slot 4 holds the credentials, if any, for the repository object handed back.
+  lua_settop(L, 4);
+  clone_operation_t* clone = (clone_operation_t*)lua_newoperation(L, sizeof(clone_operation_t), "clone", git_clone_callback);
+  luaL_setmetatable(L, API_GIT_CLONE);
+  clone->operation.results = git_clone_results;
+  clone->operation.no_repository = 1;
+  clone->url = url;
+  clone->path = path;
+  if (lua_istable(L, 3)) {
+    if (lua_getfield(L, 3, "branch") != LUA_TNIL)
+      clone->branch = strdup(luaL_checkstring(L, -1));
+    lua_pop(L, 1);
+    clone->single_branch = lua_getoptboolean(L, 3, "single_branch", 0);
+    if (lua_getfield(L, 3, "depth") != LUA_TNIL) {
+      #if LIBGIT2_VER_MAJOR > 1 || LIBGIT2_VER_MINOR >= 7
+        clone->depth = luaL_checkinteger(L, -1);
+      #else
+        return luaL_error(L, "shallow clones require libgit2 1.7 or later");
+      #endif
+    }
+    lua_pop(L, 1);
+    if (lua_getfield(L, 3, "credentials") != LUA_TNIL) {
+      luaL_checktype(L, -1, LUA_TTABLE);
+      lua_getfield(L, -1, "username");
+      lua_getfield(L, -2, "password");
+      clone->operation.username = luaL_checkstring(L, -2);
+      clone->operation.password = luaL_checkstring(L, -1);
+      lua_pop(L, 2);
+      lua_replace(L, 4);
+    } else
+      lua_pop(L, 1);
+    if (lua_getfield(L, 3, "progress") != LUA_TNIL) {
+      luaL_checktype(L, -1, LUA_TFUNCTION);
+      lua_replace(L, 3);
+      clone->operation.progress_callback = 3;
+    } else
+      lua_pop(L, 1);
+  }
+  clone->worker = create_worker(path);
+  return f_git_operation(L, clone->worker, &clone->operation);
+}
+
+// Base blobs for buffer diffs are cached per path, so that diffing on every keystroke costs only the diff itself. Each
+// call still looks up the id the index (or HEAD) has for the path, which doesn't touch the blob, and reloads the base
+// if it's changed. The most recently used bases are kept at the front of the list.
+#define DIFF_BASE_CACHE_SIZE 64
+// Unchanged lines either side of an edit that are rediffed along with it, so that the diff has room to realign.
+#define DIFF_EDIT_CONTEXT 3
+
+typedef struct {
+  int* values;
+  size_t count;
+  size_t capacity;
+  int old_offset;
+  int new_offset;
+} diff_hunks_t;
+
+typedef struct diff_base_t {
+  struct diff_base_t* next;
+  char* path;
+  int head;
+  int loaded;
+  git_oid id;
+  git_buf content;
+  // Where each of the base's lines starts, followed by its end, so that any run of lines can be diffed on its own.
+  size_t* line_starts;
+  int line_count;
+  // The last diff against this base, and the number of lines in the buffer it was taken of; edits are rediffed from it.
+  diff_hunks_t hunks;
+  int buffer_lines;
+  int diffed;
+} diff_base_t;
+
+typedef struct {
+  diff_base_t* bases;
+} diff_cache_t;
+
+static void free_diff_base(diff_base_t* base) {
+  git_buf_dispose(&base->content);
+  free(base->line_starts);
+  free(base->hunks.values);
+  free(base->path);
+  free(base);
+}
+
+static void free_diff_cache(diff_cache_t* cache) {
+  while (cache->bases) {
+    diff_base_t* base = cache->bases;
+    cache->bases = base->next;
+    free_diff_base(base);
+  }
+  free(cache);
+}
+
+static diff_cache_t* luaL_checkdiffcache(lua_State* L, int idx) {
+  luaL_checkinternal(L, idx, API_GIT_REPO);
+  lua_getfield(L, idx, "diff_cache");
+  diff_cache_t* cache = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (!cache) {
+    cache = calloc(1, sizeof(diff_cache_t));
+    lua_pushlightuserdata(L, cache);
+    lua_setfield(L, idx < 0 ? idx - 1 : idx, "diff_cache");
+  }
+  return cache;
+}
+
+// Returns GIT_ENOTFOUND if the path has no base, as with a new file.
+static int diff_base_id(git_repository* repository, const char* path, int head, git_oid* id) {
+  int error;
+  if (head) {
+    git_reference* reference;
+    git_object* tree;
+    git_tree_entry* entry;
+    if ((error = git_repository_head(&reference, repository)))
+      return error == GIT_EUNBORNBRANCH ? GIT_ENOTFOUND : error;
+    error = git_reference_peel(&tree, reference, GIT_OBJECT_TREE);
+    git_reference_free(reference);
+    if (error)
+      return error;
+    error = git_tree_entry_bypath(&entry, (git_tree*)tree, path);
+    git_object_free(tree);
+    if (!error) {
+      git_oid_cpy(id, git_tree_entry_id(entry));
+      git_tree_entry_free(entry);
+    }
+    return error;
+  }
+  git_index* index;
+  if ((error = git_repository_index(&index, repository)))
+    return error;
+  // Only rereads the index if it's changed on disk.
+  if (!(error = git_index_read(index, 0))) {
+    const git_index_entry* entry = git_index_get_bypath(index, path, 0);
+    if (entry)
+      git_oid_cpy(id, &entry->id);
+    else
+      error = GIT_ENOTFOUND;
+  }
+  git_index_free(index);
+  return error;
+}
+
+static const char* diff_next_line(const char* line, const char* end) {
+  const char* newline = memchr(line, '\n', end - line);
+  return newline ? newline + 1 : end;
+}
+
+static void diff_base_index(diff_base_t* base) {
+  const char* text = base->content.ptr;
+  const char* end = text + base->content.size;
+  size_t capacity = 64;
+  base->line_count = 0;
+  base->line_starts = realloc(base->line_starts, sizeof(size_t) * capacity);
+  for (const char* line = text; line < end; line = diff_next_line(line, end)) {
+    if (base->line_count + 2 > capacity) {
+      capacity *= 2;
+      base->line_starts = realloc(base->line_starts, sizeof(size_t) * capacity);
+    }
+    base->line_starts[base->line_count++] = line - text;
+  }
+  base->line_starts[base->line_count] = base->content.size;
+}
+
+static diff_base_t* diff_cache_base(diff_cache_t* cache, git_repository* repository, const char* path, int head) {
+  git_oid id;
+  memset(&id, 0, sizeof(id));
+  int error = diff_base_id(repository, path, head, &id);
+  if (error && error != GIT_ENOTFOUND)
+    return NULL;
+  diff_base_t* base = NULL;
+  size_t count = 0;
+  for (diff_base_t** link = &cache->bases; *link; link = &(*link)->next, ++count) {
+    if ((*link)->head == head && strcmp((*link)->path, path) == 0) {
+      base = *link;
+      *link = base->next;
+      break;
+    }
+  }
+  if (!base) {
+    base = calloc(1, sizeof(diff_base_t));
+    base->path = strdup(path);
+    base->head = head;
+    // Making room for the new entry; the list's otherwise already at the limit.
+    if (count >= DIFF_BASE_CACHE_SIZE) {
+      diff_base_t** link = &cache->bases;
+      while ((*link)->next)
+        link = &(*link)->next;
+      free_diff_base(*link);
+      *link = NULL;
+    }
+  }
+  base->next = cache->bases;
+  cache->bases = base;
+  if (base->loaded && git_oid_equal(&base->id, &id))
+    return base;
+  git_buf_dispose(&base->content);
+  git_oid_cpy(&base->id, &id);
+  base->loaded = 0;
+  base->diffed = 0;
+  // An empty base; everything in the buffer is added.
+  if (error == GIT_ENOTFOUND) {
+    base->loaded = 1;
+    diff_base_index(base);
+    return base;
+  }
+  git_blob* blob;
+  git_blob_filter_options options = GIT_BLOB_FILTER_OPTIONS_INIT;
+  if (git_blob_lookup(&blob, repository, &id))
+    return NULL;
+  // Filtered to the working tree's form, line endings and all, to match what's in the editor.
+  error = git_blob_filter(&base->content, blob, path, &options);
+  git_blob_free(blob);
+  if (error)
+    return NULL;
+  base->loaded = 1;
+  diff_base_index(base);
+  return base;
+}
+
+static void diff_hunks_push(diff_hunks_t* hunks, int old_start, int old_lines, int new_start, int new_lines) {
+  if (hunks->count + 4 > hunks->capacity) {
+    hunks->capacity = hunks->capacity ? hunks->capacity * 2 : 64;
+    hunks->values = realloc(hunks->values, sizeof(int) * hunks->capacity);
+  }
+  hunks->values[hunks->count++] = old_start;
+  hunks->values[hunks->count++] = old_lines;
+  hunks->values[hunks->count++] = new_start;
+  hunks->values[hunks->count++] = new_lines;
+}
+
+static int diff_hunk_callback(const git_diff_delta* delta, const git_diff_hunk* hunk, void* payload) {
+  diff_hunks_t* hunks = payload;
+  diff_hunks_push(hunks, hunk->old_start + hunks->old_offset, hunk->old_lines, hunk->new_start + hunks->new_offset, hunk->new_lines);
+  return 0;
+}
+
+static void lua_pushhunks(lua_State* L, const diff_hunks_t* hunks) {
+  lua_createtable(L, hunks->count, 0);
+  for (size_t i = 0; i < hunks->count; ++i) {
+    lua_pushinteger(L, hunks->values[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+}
+
+// The buffer is either a string, or a table of lines, like a doc's; with a table, an edit can be rediffed without
+// going through the rest of the buffer.
+static int diff_buffer_line_count(lua_State* L, int idx) {
+  if (lua_istable(L, idx))
+    return lua_rawlen(L, idx);
+  size_t length;
+  const char* text = lua_tolstring(L, idx, &length);
+  int count = 0;
+  for (const char* line = text; line < text + length; line = diff_next_line(line, text + length))
+    ++count;
+  return count;
+}
+
+// Pushes `count` lines of the buffer from `first` on as a single string.
+static const char* diff_buffer_push_lines(lua_State* L, int idx, int first, int count, size_t* length) {
+  if (lua_istable(L, idx)) {
+    luaL_Buffer buffer;
+    luaL_buffinit(L, &buffer);
+    for (int i = 0; i < count; ++i) {
+      lua_rawgeti(L, idx, first + i);
+      if (!lua_isstring(L, -1))
+        luaL_error(L, "buffer line %d isn't a string", first + i);
+      luaL_addvalue(&buffer);
+    }
+    luaL_pushresult(&buffer);
+  } else {
+    size_t size;
+    const char* text = lua_tolstring(L, idx, &size);
+    const char *start = text, *end = text;
+    for (int i = 1; i < first; ++i)
+      start = diff_next_line(start, text + size);
+    end = start;
+    for (int i = 0; i < count; ++i)
+      end = diff_next_line(end, text + size);
+    if (start == text && end == text + size)
+      lua_pushvalue(L, idx);
+    else
+      lua_pushlstring(L, start, end - start);
+  }
+  return lua_tolstring(L, -1, length);
+}
+
+// Diffs `old_count` base lines from `old_first` against text that starts at buffer line `new_first`, appending the hunks
+// in buffer coordinates. Lines the two share at either end are trimmed first, which an edit's context usually is.
+static int diff_window(diff_base_t* base, int old_first, int old_count, const char* text, size_t length, int new_first, const char* path, diff_hunks_t* hunks) {
+  const char* end = text + length;
+  while (old_count > 0 && text < end) {
+    const char* next = diff_next_line(text, end);
+    size_t size = base->line_starts[old_first] - base->line_starts[old_first - 1];
+    if (size != (size_t)(next - text) || memcmp(base->content.ptr + base->line_starts[old_first - 1], text, size) != 0)
+      break;
+    ++old_first;
+    --old_count;
+    ++new_first;
+    text = next;
+  }
+  while (old_count > 0 && text < end) {
+    const char* last = end - 1;
+    while (last > text && last[-1] != '\n')
+      --last;
+    int line = old_first + old_count - 1;
+    size_t size = base->line_starts[line] - base->line_starts[line - 1];
+    if (size != (size_t)(end - last) || memcmp(base->content.ptr + base->line_starts[line - 1], last, size) != 0)
+      break;
+    --old_count;
+    end = last;
+  }
+  if (old_count == 0 && text == end)
+    return 0;
+  git_diff_options options = GIT_DIFF_OPTIONS_INIT;
+  options.context_lines = 0;
+  options.interhunk_lines = 0;
+  hunks->old_offset = old_first - 1;
+  hunks->new_offset = new_first - 1;
+  const char* old_text = base->content.ptr ? base->content.ptr + base->line_starts[old_first - 1] : "";
+  size_t old_length = base->line_starts[old_first - 1 + old_count] - base->line_starts[old_first - 1];
+  int error = git_diff_buffers(old_text, old_length, path, text, end - text, path, &options, NULL, NULL, diff_hunk_callback, NULL, hunks);
+  hunks->old_offset = hunks->new_offset = 0;
+  return error;
+}
+
+// The span of buffer lines a hunk covers; a deletion covers none, and sits just after its new_start.
+static void diff_hunk_span(const int* hunk, int* first, int* end) {
+  *first = hunk[3] ? hunk[2] : hunk[2] + 1;
+  *end = *first + hunk[3];
+}
+
+// Rediffs just the window around an edit, which replaced `old_lines` lines from `start` in the last diffed buffer with
+// `new_lines` lines; the window is widened by some context, and to take in any hunk it touches, so that its edges are
+// unchanged lines whose base line is known. Hunks either side are kept, those after shifted by the change in length.
+// Returns 1 if the edit doesn't fit the last diff, and the whole buffer needs diffing.
+static int diff_buffer_edit(lua_State* L, int idx, diff_base_t* base, const char* path, int start, int old_lines, int new_lines, diff_hunks_t* hunks) {
+  const diff_hunks_t* last = &base->hunks;
+  int delta = new_lines - old_lines;
+  int first = start - DIFF_EDIT_CONTEXT, end = start + old_lines + DIFF_EDIT_CONTEXT;
+  if (first < 1)
+    first = 1;
+  if (end > base->buffer_lines + 1)
+    end = base->buffer_lines + 1;
+  for (int widened = 1; widened; ) {
+    widened = 0;
+    for (size_t i = 0; i < last->count; i += 4) {
+      int hunk_first, hunk_end;
+      diff_hunk_span(&last->values[i], &hunk_first, &hunk_end);
+      if (hunk_first <= end && hunk_end >= first && (hunk_first < first || hunk_end > end)) {
+        first = hunk_first < first ? hunk_first : first;
+        end = hunk_end > end ? hunk_end : end;
+        widened = 1;
+      }
+    }
+  }
+  // Lines outside any hunk are offset from their base line by the growth of the hunks before them.
+  int offset_before = 0, offset_within = 0;
+  size_t before = 0, after = last->count;
+  for (size_t i = 0; i < last->count; i += 4) {
+    int hunk_first, hunk_end;
+    diff_hunk_span(&last->values[i], &hunk_first, &hunk_end);
+    if (hunk_end < first) {
+      offset_before += last->values[i + 3] - last->values[i + 1];
+      before = i + 4;
+    } else if (hunk_first <= end)
+      offset_within += last->values[i + 3] - last->values[i + 1];
+    else if (after == last->count)
+      after = i;
+  }
+  int old_first = first - offset_before, old_end = end - offset_before - offset_within;
+  if (old_first < 1 || old_end < old_first || old_end > base->line_count + 1 || end + delta < first)
+    return 1;
+  for (size_t i = 0; i < before; i += 4)
+    diff_hunks_push(hunks, last->values[i], last->values[i + 1], last->values[i + 2], last->values[i + 3]);
+  size_t length;
+  const char* text = diff_buffer_push_lines(L, idx, first, end + delta - first, &length);
+  int error = diff_window(base, old_first, old_end - old_first, text, length, first, path, hunks);
+  lua_pop(L, 1);
+  for (size_t i = after; i < last->count; i += 4)
+    diff_hunks_push(hunks, last->values[i], last->values[i + 1], last->values[i + 2] + delta, last->values[i + 3]);
+  return error;
+}
+
+// Diffs a buffer, as a string or a table of lines, against the path's blob in the index, or with { base = "head" }, in
+// HEAD. Returns a flat array of old_start, old_lines, new_start, new_lines, ...; one per hunk, without context, so a hunk
+// with no old lines is an addition, and one with no new lines, a deletion (after new_start). Passing
+// { edit = { start, old_lines, new_lines } } for the lines changed since the last call on the same path and base only
+// rediffs around them; edits made in between should be merged into one range.
+static int f_git_repo_diff_buffer(lua_State* L) {
+  git_repository* repository = luaL_checkinternal(L, 1, API_GIT_REPO);
+  const char* path = luaL_checkstring(L, 2);
+  if (!lua_istable(L, 3))
+    luaL_checkstring(L, 3);
+  int head = 0, edit = 0;
+  lua_Integer start = 0, old_lines = 0, new_lines = 0;
+  if (lua_istable(L, 4)) {
+    lua_getfield(L, 4, "base");
+    const char* base = luaL_optstring(L, -1, "index");
+    if (strcmp(base, "head") == 0) head = 1;
+    else if (strcmp(base, "index") != 0) return luaL_error(L, "unknown diff base %s", base);
+    lua_pop(L, 1);
+    if (lua_getfield(L, 4, "edit") != LUA_TNIL) {
+      luaL_checktype(L, -1, LUA_TTABLE);
+      if (!lua_getoptinteger(L, -1, "start", &start) || !lua_getoptinteger(L, -1, "old_lines", &old_lines) || !lua_getoptinteger(L, -1, "new_lines", &new_lines))
+        return luaL_error(L, "an edit needs start, old_lines and new_lines");
+      edit = 1;
+    }
+    lua_pop(L, 1);
+  }
+  diff_cache_t* cache = luaL_checkdiffcache(L, 1);
+  diff_base_t* base = diff_cache_base(cache, repository, path, head);
+  if (!base)
+    return luaL_error(L, "git diff error: %s", git_error_last_string());
+  int buffer_lines = diff_buffer_line_count(L, 3);
+  diff_hunks_t hunks = { 0 };
+  int error = 1;
+  if (edit && base->diffed && start >= 1 && old_lines >= 0 && new_lines >= 0 && start + old_lines <= base->buffer_lines + 1 && base->buffer_lines + new_lines - old_lines == buffer_lines)
+    error = diff_buffer_edit(L, 3, base, path, start, old_lines, new_lines, &hunks);
+  if (error > 0) {
+    size_t length;
+    const char* text = diff_buffer_push_lines(L, 3, 1, buffer_lines, &length);
+    hunks.count = 0;
+    error = diff_window(base, 1, base->line_count, text, length, 1, path, &hunks);
+    lua_pop(L, 1);
+  }
+  if (error) {
+    free(hunks.values);
+    base->diffed = 0;
+    return luaL_error(L, "git diff error: %s", git_error_last_string());
+  }
+  free(base->hunks.values);
+  base->hunks = hunks;
+  base->buffer_lines = buffer_lines;
+  base->diffed = 1;
+  lua_pushhunks(L, &base->hunks);
+  return 1;
+}
+
+// Blame is cached on the worker per path and HEAD, a line at a time: each line of the file as of HEAD is either not yet
+// blamed, or holds the index of its commit in the entry's table of distinct commits. A request only runs blame over the
+// part of its range that isn't already annotated, so scrolling back over lines that have been seen costs nothing. A new
+// HEAD starts a fresh entry for the path.
+#define BLAME_CACHE_SIZE 16
+
+typedef struct {
+  git_oid id;
+  char* author;
+  git_time_t time;
+  char* summary;
+} blame_commit_t;
+
+typedef struct blame_entry_t {
+  struct blame_entry_t* next;
+  char* path;
+  git_oid head;
+  int* lines;
+  size_t line_count;
+  blame_commit_t* commits;
+  size_t commit_count;
+  size_t commit_capacity;
+} blame_entry_t;
+
+struct blame_cache_t {
+  blame_entry_t* entries;
+};
+
+typedef struct {
+  operation_t operation;
+  const char* path;
+  size_t min_line;
+  size_t max_line;
+  int binary;
+  // Each requested line, as an index into commits, counting from one; those are just the commits the range refers to.
+  int* lines;
+  size_t line_count;
+  blame_commit_t* commits;
+  size_t commit_count;
+} blame_operation_t;
+
+static void free_blame_commits(blame_commit_t* commits, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    free(commits[i].author);
+    free(commits[i].summary);
+  }
+  free(commits);
+}
+
+static void free_blame_entry(blame_entry_t* entry) {
+  free_blame_commits(entry->commits, entry->commit_count);
+  free(entry->lines);
+  free(entry->path);
+  free(entry);
+}
+
+static void free_blame_cache(blame_cache_t* cache) {
+  while (cache->entries) {
+    blame_entry_t* entry = cache->entries;
+    cache->entries = entry->next;
+    free_blame_entry(entry);
+  }
+  free(cache);
+}
+
+static int blame_count_lines(git_repository* repository, const git_oid* head, const char* path, size_t* count) {
+  git_commit* commit;
+  git_tree* tree;
+  git_tree_entry* entry;
+  git_blob* blob;
+  if (git_commit_lookup(&commit, repository, head))
+    return -1;
+  int error = git_commit_tree(&tree, commit);
+  git_commit_free(commit);
+  if (error)
+    return error;
+  error = git_tree_entry_bypath(&entry, tree, path);
+  git_tree_free(tree);
+  if (error)
+    return error;
+  error = git_blob_lookup(&blob, repository, git_tree_entry_id(entry));
+  git_tree_entry_free(entry);
+  if (error)
+    return error;
+  const char* content = git_blob_rawcontent(blob);
+  const char* end = content + git_blob_rawsize(blob);
+  *count = 0;
+  for (const char* line = content; line < end; line = diff_next_line(line, end))
+    ++*count;
+  git_blob_free(blob);
+  return 0;
+}
+
+static blame_entry_t* blame_cache_entry(git_repository* repository, blame_cache_t* cache, const char* path, const git_oid* head) {
+  blame_entry_t* entry = NULL;
+  size_t count = 0;
+  for (blame_entry_t** link = &cache->entries; *link; ) {
+    blame_entry_t* candidate = *link;
+    if (strcmp(candidate->path, path) == 0) {
+      *link = candidate->next;
+      // Blame as of an earlier HEAD is rarely wanted again.
+      if (git_oid_equal(&candidate->head, head))
+        entry = candidate;
+      else
+        free_blame_entry(candidate);
+    } else {
+      link = &candidate->next;
+      ++count;
+    }
+  }
+  if (!entry) {
+    size_t line_count;
+    if (blame_count_lines(repository, head, path, &line_count))
+      return NULL;
+    if (count >= BLAME_CACHE_SIZE) {
+      blame_entry_t** link = &cache->entries;
+      while ((*link)->next)
+        link = &(*link)->next;
+      free_blame_entry(*link);
+      *link = NULL;
+    }
+    entry = calloc(1, sizeof(blame_entry_t));
+    entry->path = strdup(path);
+    git_oid_cpy(&entry->head, head);
+    entry->line_count = line_count;
+    entry->lines = calloc(line_count ? line_count : 1, sizeof(int));
+  }
+  entry->next = cache->entries;
+  cache->entries = entry;
+  return entry;
+}
+
+static int blame_entry_commit(git_repository* repository, blame_entry_t* entry, const git_oid* id) {
+  // Neighbouring hunks tend to share recent commits.
+  for (size_t i = entry->commit_count; i > 0; --i) {
+    if (git_oid_equal(&entry->commits[i - 1].id, id))
+      return i - 1;
+  }
+  git_commit* commit;
+  if (git_commit_lookup(&commit, repository, id))
+    return -1;
+  if (entry->commit_count == entry->commit_capacity) {
+    entry->commit_capacity = entry->commit_capacity ? entry->commit_capacity * 2 : 16;
+    entry->commits = realloc(entry->commits, sizeof(blame_commit_t) * entry->commit_capacity);
+  }
+  blame_commit_t* blame_commit = &entry->commits[entry->commit_count];
+  const git_signature* author = git_commit_author(commit);
+  const char* summary = git_commit_summary(commit);
+  git_oid_cpy(&blame_commit->id, id);
+  blame_commit->author = strdup(author->name);
+  blame_commit->time = author->when.time;
+  blame_commit->summary = strdup(summary ? summary : "");
+  git_commit_free(commit);
+  return entry->commit_count++;
+}
+
+static int git_repo_blame_callback(worker_t* worker, operation_t* operation) {
+  blame_operation_t* blame = (blame_operation_t*)operation;
+  git_oid head;
+  if (git_reference_name_to_id(&head, worker->repository, "HEAD"))
+    return -1;
+  if (!worker->blame_cache)
+    worker->blame_cache = calloc(1, sizeof(blame_cache_t));
+  blame_entry_t* entry = blame_cache_entry(worker->repository, worker->blame_cache, blame->path, &head);
+  if (!entry)
+    return -1;
+  size_t min_line = blame->min_line ? blame->min_line : 1;
+  size_t max_line = blame->max_line && blame->max_line < entry->line_count ? blame->max_line : entry->line_count;
+  size_t first = min_line, last = max_line;
+  while (first <= last && entry->lines[first - 1])
+    ++first;
+  while (last >= first && entry->lines[last - 1])
+    --last;
+  if (first <= last) {
+    git_blame* result;
+    git_blame_options options = GIT_BLAME_OPTIONS_INIT;
+    git_oid_cpy(&options.newest_commit, &head);
+    options.min_line = first;
+    options.max_line = last;
+    if (git_blame_file(&result, worker->repository, blame->path, &options))
+      return -1;
+    int error = 0;
+    for (uint32_t i = 0, count = git_blame_get_hunk_count(result); i < count && !error; ++i) {
+      const git_blame_hunk* hunk = git_blame_get_hunk_byindex(result, i);
+      int commit = blame_entry_commit(worker->repository, entry, &hunk->final_commit_id);
+      if (commit < 0)
+        error = -1;
+      for (size_t line = hunk->final_start_line_number; !error && line < hunk->final_start_line_number + hunk->lines_in_hunk; ++line) {
+        if (line >= first && line <= last)
+          entry->lines[line - 1] = commit + 1;
+      }
+    }
+    git_blame_free(result);
+    if (error)
+      return -1;
+  }
+  // Copied out, as the entry may be dropped before the results are read.
+  blame->line_count = max_line >= min_line ? max_line - min_line + 1 : 0;
+  blame->lines = malloc(sizeof(int) * (blame->line_count ? blame->line_count : 1));
+  blame->commits = malloc(sizeof(blame_commit_t) * (entry->commit_count ? entry->commit_count : 1));
+  int* renumbered = calloc(entry->commit_count ? entry->commit_count : 1, sizeof(int));
+  for (size_t i = 0; i < blame->line_count; ++i) {
+    int commit = entry->lines[min_line - 1 + i] - 1;
+    if (commit >= 0 && !renumbered[commit]) {
+      blame_commit_t* copy = &blame->commits[blame->commit_count++];
+      *copy = entry->commits[commit];
+      copy->author = strdup(copy->author);
+      copy->summary = strdup(copy->summary);
+      renumbered[commit] = blame->commit_count;
+    }
+    blame->lines[i] = commit >= 0 ? renumbered[commit] : 0;
+  }
+  free(renumbered);
+  return 0;
+}
+
+// Returns two tables: lines, the commit for each line from min_line on, as an index into commits; and commits, a flat
+// array of id, author, time, summary, id, ..., for each distinct commit in the range.
+static int git_repo_blame_results(lua_State* L, operation_t* operation) {
+  blame_operation_t* blame = (blame_operation_t*)operation;
+  lua_createtable(L, blame->line_count, 0);
+  for (size_t i = 0; i < blame->line_count; ++i) {
+    lua_pushinteger(L, blame->lines[i]);
+    lua_rawseti(L, -2, i + 1);
   }
-  if (git_annotated_commit_lookup(&commit, repository, &commit_id))
-    return luaL_error(L, "git commit lookup error: %s", git_error_last_string());
-  int result = git_merge(repository, (const git_annotated_commit**)&commit, 1, &merge_options, &checkout_options);
-  git_annotated_commit_free(commit);
-  if (result)
-    return luaL_error(L, "git merge error: %s", git_error_last_string());
-  git_index* index;
-  git_repository_index(&index, repository);
-  if (git_index_has_conflicts(index)) {
-    git_index_free(index);
-    return luaL_error(L, "git merge has conflicts");
+  lua_createtable(L, blame->commit_count * 4, 0);
+  for (size_t i = 0; i < blame->commit_count; ++i) {
+    lua_pushoid(L, &blame->commits[i].id, blame->binary);
+    lua_rawseti(L, -2, i * 4 + 1);
+    lua_pushstring(L, blame->commits[i].author);
+    lua_rawseti(L, -2, i * 4 + 2);
+    lua_pushinteger(L, blame->commits[i].time);
+    lua_rawseti(L, -2, i * 4 + 3);
+    lua_pushstring(L, blame->commits[i].summary);
+    lua_rawseti(L, -2, i * 4 + 4);
   }
-  lua_pushboolean(L, 1);
-  git_index_free(index);
-  return 1;
+  free(blame->lines);
+  free_blame_commits(blame->commits, blame->commit_count);
+  blame->lines = NULL;
+  blame->commits = NULL;
+  return 2;
 }
 
+// Blames the path as of HEAD. Takes an optional table of options: min_line and max_line, the range to annotate, which
+// defaults to the whole file, and is clipped to its end.
+static int f_git_repo_blame(lua_State* L) {
+  worker_t* worker = luaL_checkworker(L, 1);
+  const char* path = luaL_checkstring(L, 2);
+  blame_operation_t* blame = (blame_operation_t*)lua_newoperation(L, sizeof(blame_operation_t), "blame", git_repo_blame_callback);
+  int operation_index = lua_gettop(L);
+  blame->operation.results = git_repo_blame_results;
+  blame->path = path;
+  blame->binary = lua_isbinaryoids(L, 1);
+  if (lua_istable(L, 3)) {
+    lua_Integer value;
+    if (lua_getoptinteger(L, 3, "min_line", &value)) {
+      if (value < 1)
+        return luaL_error(L, "blame lines start at 1");
+      blame->min_line = value;
+    }
+    if (lua_getoptinteger(L, 3, "max_line", &value)) {
+      if (value < 1)
+        return luaL_error(L, "blame lines start at 1");
+      blame->max_line = value;
+    }
+  }
+  if (lua_gettop(L) != operation_index)
+    lua_pushvalue(L, operation_index);
+  return f_git_operation(L, worker, &blame->operation);
+}
 
+// Searching history for lines added or removed that contain a string, like git log -G with a fixed string (not -S: every
+// matching line is reported, so a moved line shows up as both removed and added, and occurrences aren't counted), but
+// with the diffing and matching of each batch of commits fanned out over a number of threads, each with its own
+// repository handle, drawing helpers from the pool's shared budget as checkouts do. Like a log, a search is an operation
+// re-queued on the worker for each batch; the revision walk stays on the worker's handle, and the threads' handles are
+// kept open between batches.
+#define SEARCH_DEFAULT_WORKERS 4
+#define SEARCH_DEFAULT_BATCH_SIZE 512
+// As with git log --since, the walk only stops once this many commits in a row are older than the cutoff, as commit times
+// aren't strictly ordered.
+#define SEARCH_SINCE_SLOP 5
+static int search_workers = SEARCH_DEFAULT_WORKERS;
 
-static int f_git_repo_commit(lua_State* L) {
-  git_repository* repository = luaL_checkinternal(L, 1, API_GIT_REPO);
-  const char* commit_message = luaL_checkstring(L, 2);
-  git_signature *me = NULL;
-  git_index *index;
-  lua_getfield(L, 1, "credentials");
-  lua_getfield(L, -1, "email");
-  const char* email = luaL_checkstring(L, -1);
-  lua_getfield(L, -2, "name");
-  const char* name = luaL_checkstring(L, -1);
-  int error = git_signature_now(&me, name, email);
-  git_commit* commit = git_retrieve_commit(L, repository, "HEAD");
-  git_oid new_commit_id;
-  git_oid tree_id;
-  git_tree* tree;
-  if (git_repository_index(&index, repository))
-    return luaL_error(L, "git index error: %s", git_error_last_string());
-  if (git_index_write_tree(&tree_id, index))
-    return luaL_error(L, "git write tree error: %s", git_error_last_string());
-  if (git_tree_lookup(&tree, repository, &tree_id))
-    return luaL_error(L, "git tree lookup error: %s", git_error_last_string());
-  error = git_commit_create(
-    &new_commit_id,
-    repository,
-    "HEAD",                      /* name of ref to update */
-    me,                          /* author */
-    me,                          /* committer */
-    "UTF-8",                     /* message encoding */
-    commit_message,              /* message */
-    tree,                        /* root tree */
-    1,                           /* parent count */
-    (const git_commit**)&commit);                    /* parents */
-  if (error)
-    return luaL_error(L, "git commit error: %s", git_error_last_string());
-  lua_pushhex(L, (char*)new_commit_id.id, sizeof(new_commit_id.id));
-  return 1;
+typedef struct {
+  char* path;
+  char sign;
+  int line;
+  char* text;
+} search_match_t;
+
+typedef struct {
+  git_oid id;
+  git_time_t time;
+  search_match_t* matches;
+  size_t count;
+  size_t capacity;
+} search_commit_t;
+
+typedef struct {
+  operation_t operation;
+  worker_t* worker;
+  git_revwalk* walk;
+  char* pattern;
+  size_t pattern_length;
+  string_list_t paths;
+  git_time_t since;
+  int older;
+  int binary;
+  int done;
+  search_commit_t* commits;
+  size_t count;
+  size_t batch_size;
+  git_repository** repositories;
+  int repository_count;
+  // Shared between the threads during a batch.
+  mutex_t* mutex;
+  size_t next;
+  int failed;
+  char error[512];
+} search_operation_t;
+
+typedef struct {
+  search_operation_t* search;
+  int index;
+} search_thread_t;
+
+typedef struct {
+  search_operation_t* search;
+  search_commit_t* commit;
+} search_payload_t;
+
+static void free_search_commits(search_operation_t* search) {
+  for (size_t i = 0; i < search->count; ++i) {
+    for (size_t j = 0; j < search->commits[i].count; ++j) {
+      free(search->commits[i].matches[j].path);
+      free(search->commits[i].matches[j].text);
+    }
+    free(search->commits[i].matches);
+  }
+  search->count = 0;
 }
 
-static int f_git_repo_lookup(lua_State* L) {
-  git_repository* repository = luaL_checkinternal(L, 1, API_GIT_REPO);
-  const char* commit_name = luaL_checkstring(L, 2);
-  git_oid commit_id;
-  if (git_get_id(&commit_id, repository, commit_name))
-    return luaL_error(L, "git reference lookup error: %s", git_error_last_string());
-  lua_pushhex(L, (char*)commit_id.id, sizeof(commit_id.id));
-  return 1;
+static int search_contains(const char* text, size_t length, const char* pattern, size_t pattern_length) {
+  for (const char* end = text + length; (size_t)(end - text) >= pattern_length; ++text) {
+    if (!(text = memchr(text, pattern[0], end - text - pattern_length + 1)))
+      return 0;
+    if (memcmp(text, pattern, pattern_length) == 0)
+      return 1;
+  }
+  return 0;
 }
 
-static int matched_path_callback(const char *path, const char *matched_pathspec, void *L) {
-  lua_pushstring(L, path);
+static int search_line_callback(const git_diff_delta* delta, const git_diff_hunk* hunk, const git_diff_line* line, void* data) {
+  search_payload_t* payload = data;
+  if ((line->origin != GIT_DIFF_LINE_ADDITION && line->origin != GIT_DIFF_LINE_DELETION) || !search_contains(line->content, line->content_len, payload->search->pattern, payload->search->pattern_length))
+    return 0;
+  search_commit_t* commit = payload->commit;
+  if (commit->count == commit->capacity) {
+    commit->capacity = commit->capacity ? commit->capacity * 2 : 8;
+    commit->matches = realloc(commit->matches, sizeof(search_match_t) * commit->capacity);
+  }
+  search_match_t* match = &commit->matches[commit->count++];
+  size_t length = line->content_len;
+  while (length > 0 && (line->content[length - 1] == '\n' || line->content[length - 1] == '\r'))
+    --length;
+  match->path = strdup(line->origin == GIT_DIFF_LINE_ADDITION ? delta->new_file.path : delta->old_file.path);
+  match->sign = line->origin;
+  match->line = line->origin == GIT_DIFF_LINE_ADDITION ? line->new_lineno : line->old_lineno;
+  match->text = malloc(length + 1);
+  memcpy(match->text, line->content, length);
+  match->text[length] = 0;
   return 0;
 }
 
-static int f_git_repo_add(lua_State* L) {
-  git_repository* repository = luaL_checkinternal(L, 1, API_GIT_REPO);
-  const char* path = luaL_checkstring(L, 2);
+// Diffs the commit against its parent and collects the matching lines. Merges are skipped, as git log -G does by default.
+static int search_commit(git_repository* repository, search_operation_t* search, search_commit_t* commit) {
+  git_commit* object;
+  git_tree *tree = NULL, *parent_tree = NULL;
+  if (git_commit_lookup(&object, repository, &commit->id))
+    return -1;
+  commit->time = git_commit_time(object);
+  unsigned int parent_count = git_commit_parentcount(object);
+  int error = parent_count > 1 ? 0 : git_commit_tree(&tree, object);
+  if (!error && parent_count == 1) {
+    git_commit* parent;
+    if (!(error = git_commit_parent(&parent, object, 0))) {
+      error = git_commit_tree(&parent_tree, parent);
+      git_commit_free(parent);
+    }
+  }
+  git_commit_free(object);
+  if (!error && tree) {
+    git_diff* diff;
+    git_diff_options options = GIT_DIFF_OPTIONS_INIT;
+    options.context_lines = 0;
+    options.interhunk_lines = 0;
+    options.pathspec.strings = search->paths.strings;
+    options.pathspec.count = search->paths.count;
+    if (!(error = git_diff_tree_to_tree(&diff, repository, parent_tree, tree, &options))) {
+      search_payload_t payload = { search, commit };
+      error = git_diff_foreach(diff, NULL, NULL, NULL, search_line_callback, &payload);
+      git_diff_free(diff);
+    }
+  }
+  git_tree_free(tree);
+  git_tree_free(parent_tree);
+  return error;
+}
+
+static void* search_thread_callback(void* data) {
+  search_thread_t* thread = data;
+  search_operation_t* search = thread->search;
+  git_repository** repository = &search->repositories[thread->index];
+  int error = *repository ? 0 : git_repository_open(repository, search->worker->path);
+  while (!error) {
+    lock_mutex(search->mutex);
+    size_t i = search->next++;
+    int done = search->failed || i >= search->count;
+    unlock_mutex(search->mutex);
+    if (done)
+      break;
+    error = search_commit(*repository, search, &search->commits[i]);
+  }
+  if (error) {
+    lock_mutex(search->mutex);
+    if (!search->failed)
+      strncpy(search->error, git_error_last_string(), sizeof(search->error) - 1);
+    search->failed = 1;
+    unlock_mutex(search->mutex);
+  }
+  return NULL;
+}
 
-  unsigned int flags = 0;
-  if (git_status_file(&flags, repository, path))
-    return luaL_error(L, "git status error: %s", git_error_last_string());
-  if (!(flags & (GIT_STATUS_WT_MODIFIED | GIT_STATUS_WT_DELETED | GIT_STATUS_WT_NEW)))
+static int git_repo_search_callback(worker_t* worker, operation_t* operation) {
+  search_operation_t* search = (search_operation_t*)operation;
+  // Anything left over from a batch that failed part way through.
+  free_search_commits(search);
+  if (!search->walk) {
+    if (git_revwalk_new(&search->walk, worker->repository))
+      return -1;
+    git_revwalk_sorting(search->walk, GIT_SORT_TIME);
+    if (git_revwalk_push_head(search->walk))
+      return -1;
+  }
+  git_oid id;
+  int error;
+  while (search->count < search->batch_size && !(error = git_revwalk_next(&id, search->walk))) {
+    if (search->since) {
+      git_commit* commit;
+      if (git_commit_lookup(&commit, worker->repository, &id))
+        return -1;
+      int older = git_commit_time(commit) < search->since;
+      git_commit_free(commit);
+      if (older && ++search->older >= SEARCH_SINCE_SLOP) {
+        error = GIT_ITEROVER;
+        break;
+      }
+      if (older)
+        continue;
+      search->older = 0;
+    }
+    search_commit_t* commit = &search->commits[search->count++];
+    memset(commit, 0, sizeof(search_commit_t));
+    git_oid_cpy(&commit->id, &id);
+  }
+  if (error == GIT_ITEROVER)
+    search->done = 1;
+  else if (error)
+    return error;
+  if (!search->count)
     return 0;
+  if (!search->repositories) {
+    search->repository_count = search_workers;
+    search->repositories = calloc(search->repository_count, sizeof(git_repository*));
+  }
+  int workers = search->repository_count < search->count ? search->repository_count : search->count;
+  search->mutex = create_mutex();
+  search->next = 0;
+  search->failed = 0;
+  // The pool thread takes the first share itself.
+  int helpers = workers > 1 ? pool_acquire_helpers(workers - 1) : 0;
+  search_thread_t* threads = malloc(sizeof(search_thread_t) * (helpers + 1));
+  thread_t** handles = malloc(sizeof(thread_t*) * (helpers + 1));
+  for (int i = 0; i <= helpers; ++i) {
+    threads[i].search = search;
+    threads[i].index = i;
+    if (i > 0)
+      handles[i] = create_thread(search_thread_callback, &threads[i]);
+  }
+  search_thread_callback(&threads[0]);
+  for (int i = 1; i <= helpers; ++i)
+    join_thread(handles[i]);
+  pool_release_helpers(helpers);
+  free(handles);
+  free(threads);
+  close_mutex(search->mutex);
+  search->mutex = NULL;
+  if (search->failed) {
+    snprintf(operation->error, sizeof(operation->error), "search error: %s", search->error);
+    return -1;
+  }
+  return 0;
+}
 
-  git_tree *tree;
-  git_commit *commit;
-  git_index *index;
-  if (git_repository_index(&index, repository))
-    return luaL_error(L, "git index error: %s", git_error_last_string());
-  git_strarray array;
-  array.strings = (char**)&path;
-  array.count = 1;
-  int top = lua_gettop(L);
-  int value = git_index_add_all(index, &array, GIT_INDEX_ADD_FORCE, matched_path_callback, L);
-  if (!value)
-    value = git_index_write(index);
-  git_index_free(index);
-  if (value)
-    return luaL_error(L, "git add error: %s", git_error_last_string());
-  return lua_gettop(L) - top;
+// Packed as a flat array of id, time, path, sign, line, text, id, ...; for each matching line, in the order the commits
+// were walked, newest first. sign is "+" for an added line, or "-" for a removed one, and line is its number in the new
+// or old file respectively. A batch with no matches is an empty table; once the history is exhausted, returns nil.
+static int git_repo_search_results(lua_State* L, operation_t* operation) {
+  search_operation_t* search = (search_operation_t*)operation;
+  if (search->count == 0 && search->done) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_newtable(L);
+  int n = 0;
+  for (size_t i = 0; i < search->count; ++i) {
+    search_commit_t* commit = &search->commits[i];
+    for (size_t j = 0; j < commit->count; ++j) {
+      lua_pushoid(L, &commit->id, search->binary);
+      lua_rawseti(L, -2, ++n);
+      lua_pushinteger(L, commit->time);
+      lua_rawseti(L, -2, ++n);
+      lua_pushstring(L, commit->matches[j].path);
+      lua_rawseti(L, -2, ++n);
+      lua_pushlstring(L, &commit->matches[j].sign, 1);
+      lua_rawseti(L, -2, ++n);
+      lua_pushinteger(L, commit->matches[j].line);
+      lua_rawseti(L, -2, ++n);
+      lua_pushstring(L, commit->matches[j].text);
+      lua_rawseti(L, -2, ++n);
+    }
+  }
+  free_search_commits(search);
+  return 1;
+}
+
+// Searches the next batch of commits; from a coroutine, yields while the threads work. Usable directly as a for iterator.
+static int f_git_search_next(lua_State* L) {
+  search_operation_t* search = luaL_checkudata(L, 1, API_GIT_SEARCH);
+  lock_mutex(pool.mutex);
+  int running = search->operation.worker && !search->operation.complete;
+  unlock_mutex(pool.mutex);
+  if (running)
+    return luaL_error(L, "git search error: a batch is already being read");
+  if (search->done) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_settop(L, 1);
+  return f_git_operation(L, search->worker, &search->operation);
+}
+
+static int f_git_search_gc(lua_State* L) {
+  search_operation_t* search = luaL_checkudata(L, 1, API_GIT_SEARCH);
+  free_search_commits(search);
+  free(search->commits);
+  if (search->walk)
+    git_revwalk_free(search->walk);
+  for (int i = 0; i < search->repository_count; ++i) {
+    if (search->repositories[i])
+      git_repository_free(search->repositories[i]);
+  }
+  free(search->repositories);
+  free(search->pattern);
+  string_list_free(&search->paths);
+  return 0;
+}
+
+// Searches the history from HEAD for lines added or removed that contain the pattern, a plain string; each such line is
+// a match, even where it only moved within the commit. Takes an optional table of options: paths (a pathspec the diffs
+// are limited to), since (a unix time; older commits are left out), and batch (commits per batch, default 512). Returns
+// an iterator which yields the matches from successive batches of commits; see git_repo_search_results. The number of
+// threads per search is set with libgit2.options.
+static int f_git_repo_search_history(lua_State* L) {
+  worker_t* worker = luaL_checkworker(L, 1);
+  size_t pattern_length;
+  const char* pattern = luaL_checklstring(L, 2, &pattern_length);
+  if (pattern_length == 0)
+    return luaL_error(L, "search pattern can't be empty");
+  int has_options = lua_istable(L, 3);
+  search_operation_t* search = (search_operation_t*)lua_newoperation(L, sizeof(search_operation_t), "search", git_repo_search_callback);
+  int operation_index = lua_gettop(L);
+  luaL_setmetatable(L, API_GIT_SEARCH);
+  // Keeps the repository, and so the worker, alive for as long as the search is.
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, operation_index, 1);
+  search->operation.results = git_repo_search_results;
+  search->worker = worker;
+  search->binary = lua_isbinaryoids(L, 1);
+  search->pattern = malloc(pattern_length);
+  memcpy(search->pattern, pattern, pattern_length);
+  search->pattern_length = pattern_length;
+  search->batch_size = SEARCH_DEFAULT_BATCH_SIZE;
+  if (has_options) {
+    git_strarray paths;
+    if (lua_getoptstrarray(L, 3, "paths", &paths)) {
+      for (size_t i = 0; i < paths.count; ++i)
+        string_list_push(&search->paths, paths.strings[i], strlen(paths.strings[i]));
+      lua_pop(L, 2);
+    }
+    lua_Integer value;
+    if (lua_getoptinteger(L, 3, "since", &value))
+      search->since = value;
+    if (lua_getoptinteger(L, 3, "batch", &value)) {
+      if (value < 1)
+        return luaL_error(L, "search batch size must be positive");
+      search->batch_size = value;
+    }
+  }
+  search->commits = malloc(sizeof(search_commit_t) * search->batch_size);
+  return 1;
 }
 
 static int f_git_repo_gc(lua_State* L) {
-  lua_getfield(L, -1, "internal");
+  lua_getfield(L, 1, "worker");
+  if (lua_touserdata(L, -1))
+    close_worker(lua_touserdata(L, -1));
+  lua_getfield(L, 1, "diff_cache");
+  if (lua_touserdata(L, -1))
+    free_diff_cache(lua_touserdata(L, -1));
+  lua_getfield(L, 1, "internal");
   if (lua_touserdata(L, -1))
     git_repository_free(lua_touserdata(L, -1));
   return 0;
@@ -524,22 +4411,634 @@ static int f_git_remote_gc(lua_State* L) {
   return 0;
 }
 
+// libgit2's own mbedtls stream does a full handshake for every connection. We register our own TLS stream instead. It
+// shares one configuration and CA chain across all connections, and it resumes sessions: after each handshake the
+// session (including any ticket the server issued) is kept per host:port, or just per host through a proxy, and offered
+// at the start of the next connection to that host, so the server can skip the key exchange and certificate
+// verification. If a session store is configured, sessions are also written to disk and survive restarts.
+typedef struct tls_session_t {
+  struct tls_session_t* next;
+  char* key;
+  mbedtls_ssl_session session;
+} tls_session_t;
+
+// Guards the random number generator, which mbedtls doesn't lock itself, and the session list.
+static mutex_t* tls_mutex;
+static tls_session_t* tls_sessions;
+static char* tls_session_store;
+static int tls_verify = 1;
+// Serializes writes to the session store, which are done outside the tls mutex.
+static mutex_t* tls_store_mutex;
+
+static int tls_error(int error, const char* action) {
+  char message[256], buffer[320];
+  mbedtls_strerror(error, message, sizeof(message));
+  snprintf(buffer, sizeof(buffer), "tls %s error: %s", action, message);
+  git_error_set_str(GIT_ERROR_SSL, buffer);
+  return error == MBEDTLS_ERR_X509_CERT_VERIFY_FAILED ? GIT_ECERTIFICATE : -1;
+}
+
+static int tls_random(void* data, unsigned char* output, size_t length) {
+  lock_mutex(tls_mutex);
+  int error = mbedtls_ctr_drbg_random(&drbg_context, output, length);
+  unlock_mutex(tls_mutex);
+  return error;
+}
+
+// The CA chain is parsed once, when it's set with libgit2.certs, into a configuration shared by every connection. Each
+// connection checks the file's modification time and size (for a directory, the newest of its own and its entries', and
+// their total size), which is far cheaper than parsing it; if they've changed, the chain is parsed again and swapped in.
+// Connections hold a reference to the chain they started with, so a swap never pulls it out from under a handshake in
+// progress.
+typedef struct {
+  int references;
+  char* path;
+  int directory;
+  time_t mtime;
+  off_t size;
+  mbedtls_x509_crt chain;
+  mbedtls_ssl_config config;
+} tls_trust_t;
+
+// Entries are followed through symlinks, so that an edit to a certificate a hashed link points at is noticed too.
+static int tls_trust_stamp(const char* path, int directory, time_t* mtime, off_t* size) {
+  struct stat st;
+  if (stat(path, &st))
+    return -1;
+  *mtime = st.st_mtime;
+  *size = st.st_size;
+  DIR* dir = directory ? opendir(path) : NULL;
+  if (dir) {
+    char entry_path[4096];
+    struct dirent* entry;
+    *size = 0;
+    while ((entry = readdir(dir))) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        continue;
+      snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+      if (stat(entry_path, &st) == 0) {
+        if (st.st_mtime > *mtime)
+          *mtime = st.st_mtime;
+        *size += st.st_size;
+      }
+    }
+    closedir(dir);
+  }
+  return 0;
+}
+
+// Must hold the tls mutex. The current trust holds a reference to itself.
+static tls_trust_t* tls_trust;
+
+static void tls_release_trust(tls_trust_t* trust) {
+  lock_mutex(tls_mutex);
+  int references = --trust->references;
+  unlock_mutex(tls_mutex);
+  if (references == 0) {
+    mbedtls_ssl_config_free(&trust->config);
+    mbedtls_x509_crt_free(&trust->chain);
+    free(trust->path);
+    free(trust);
+  }
+}
+
+// Parses the chain at the path, or creates an empty one if there's no path; returns NULL if it can't be parsed.
+// The same suites libgit2's own mbedtls stream restricts itself to (GIT_SSL_DEFAULT_CIPHERS), rather than everything
+// mbedtls was built with; any this build of mbedtls lacks are skipped in the handshake.
+static const int tls_ciphersuites[] = {
+  MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+  MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+  MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+  MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+  MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+  MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+  MBEDTLS_TLS_DHE_RSA_WITH_AES_128_GCM_SHA256,
+  MBEDTLS_TLS_DHE_RSA_WITH_AES_256_GCM_SHA384,
+  MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
+  MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+  MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_CBC_SHA384,
+  MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_CBC_SHA384,
+  MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
+  MBEDTLS_TLS_RSA_WITH_AES_256_GCM_SHA384,
+  0
+};
+
+static tls_trust_t* tls_trust_new(const char* path, int directory) {
+  tls_trust_t* trust = calloc(1, sizeof(tls_trust_t));
+  trust->references = 1;
+  mbedtls_x509_crt_init(&trust->chain);
+  mbedtls_ssl_config_init(&trust->config);
+  if (path) {
+    trust->path = strdup(path);
+    trust->directory = directory;
+    tls_trust_stamp(path, directory, &trust->mtime, &trust->size);
+    if ((directory ? mbedtls_x509_crt_parse_path(&trust->chain, path) : mbedtls_x509_crt_parse_file(&trust->chain, path)) < 0) {
+      tls_release_trust(trust);
+      return NULL;
+    }
+  }
+  mbedtls_ssl_config_defaults(&trust->config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  mbedtls_ssl_conf_rng(&trust->config, tls_random, NULL);
+  mbedtls_ssl_conf_ciphersuites(&trust->config, tls_ciphersuites);
+  mbedtls_ssl_conf_min_version(&trust->config, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
+  // Verification is checked after the handshake; see tls_stream_connect.
+  mbedtls_ssl_conf_authmode(&trust->config, MBEDTLS_SSL_VERIFY_OPTIONAL);
+  mbedtls_ssl_conf_ca_chain(&trust->config, &trust->chain, NULL);
+  #if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&trust->config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+  #endif
+  return trust;
+}
+
+static void tls_set_trust(tls_trust_t* trust) {
+  lock_mutex(tls_mutex);
+  tls_trust_t* previous = tls_trust;
+  tls_trust = trust;
+  unlock_mutex(tls_mutex);
+  if (previous)
+    tls_release_trust(previous);
+}
+
+// Returns a reference to the current trust, reparsing it first if its file has changed.
+static tls_trust_t* tls_acquire_trust() {
+  time_t mtime;
+  off_t size;
+  lock_mutex(tls_mutex);
+  tls_trust_t* trust = tls_trust;
+  ++trust->references;
+  unlock_mutex(tls_mutex);
+  if (trust->path && tls_trust_stamp(trust->path, trust->directory, &mtime, &size) == 0 && (mtime != trust->mtime || size != trust->size)) {
+    tls_trust_t* updated = tls_trust_new(trust->path, trust->directory);
+    if (updated) {
+      lock_mutex(tls_mutex);
+      // Another connection may have beaten us to it.
+      int current = tls_trust == trust;
+      if (current) {
+        tls_trust = updated;
+        ++updated->references;
+      }
+      unlock_mutex(tls_mutex);
+      if (current) {
+        tls_release_trust(trust);
+        tls_release_trust(trust);
+        return updated;
+      }
+      tls_release_trust(updated);
+    }
+  }
+  return trust;
+}
+
+typedef struct {
+  git_stream parent;
+  // Set when wrapping another stream, such as a proxy tunnel; otherwise we own the socket.
+  git_stream* inner;
+  mbedtls_net_context net;
+  mbedtls_ssl_context ssl;
+  tls_trust_t* trust;
+  git_cert_x509 cert;
+  char* host;
+  char* port;
+  char key[512];
+} tls_stream_t;
+
+static tls_session_t* tls_find_session(const char* key) {
+  for (tls_session_t* entry = tls_sessions; entry; entry = entry->next) {
+    if (strcmp(entry->key, key) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+static int tls_sessions_equal(const mbedtls_ssl_session* a, const mbedtls_ssl_session* b) {
+  unsigned char first[4096], second[4096];
+  size_t first_length, second_length;
+  if (mbedtls_ssl_session_save(a, first, sizeof(first), &first_length) || mbedtls_ssl_session_save(b, second, sizeof(second), &second_length))
+    return 0;
+  return first_length == second_length && memcmp(first, second, first_length) == 0;
+}
+
+// Takes ownership of the session. Returns whether the store changed; a resumed session usually comes back unchanged.
+// Must hold the tls mutex.
+static int tls_store_session(const char* key, mbedtls_ssl_session* session) {
+  tls_session_t* entry = tls_find_session(key);
+  if (!entry) {
+    entry = calloc(1, sizeof(tls_session_t));
+    entry->key = strdup(key);
+    entry->next = tls_sessions;
+    tls_sessions = entry;
+  } else if (tls_sessions_equal(&entry->session, session)) {
+    mbedtls_ssl_session_free(session);
+    return 0;
+  } else
+    mbedtls_ssl_session_free(&entry->session);
+  entry->session = *session;
+  return 1;
+}
+
+static void tls_buffer_append(unsigned char** buffer, size_t* length, size_t* capacity, const void* data, size_t size) {
+  if (*length + size > *capacity) {
+    *capacity = (*length + size) * 2;
+    *buffer = realloc(*buffer, *capacity);
+  }
+  memcpy(*buffer + *length, data, size);
+  *length += size;
+}
+
+// Each entry is a two-byte key length, the key, a four-byte session length, and the session as serialized by mbedtls.
+// The file holds session secrets, so it's only readable by the user. The sessions are serialized under the tls mutex,
+// but written out after releasing it, so that handshakes on other threads don't wait on the disk.
+static void tls_save_sessions() {
+  lock_mutex(tls_store_mutex);
+  lock_mutex(tls_mutex);
+  char* path = tls_session_store ? strdup(tls_session_store) : NULL;
+  unsigned char* contents = NULL;
+  size_t length = 0, capacity = 0;
+  unsigned char buffer[4096];
+  for (tls_session_t* entry = path ? tls_sessions : NULL; entry; entry = entry->next) {
+    size_t session_length;
+    if (mbedtls_ssl_session_save(&entry->session, buffer, sizeof(buffer), &session_length))
+      continue;
+    unsigned char header[6];
+    size_t key_length = strlen(entry->key);
+    header[0] = key_length >> 8; header[1] = key_length & 0xFF;
+    header[2] = session_length >> 24; header[3] = (session_length >> 16) & 0xFF; header[4] = (session_length >> 8) & 0xFF; header[5] = session_length & 0xFF;
+    tls_buffer_append(&contents, &length, &capacity, header, 2);
+    tls_buffer_append(&contents, &length, &capacity, entry->key, key_length);
+    tls_buffer_append(&contents, &length, &capacity, &header[2], 4);
+    tls_buffer_append(&contents, &length, &capacity, buffer, session_length);
+  }
+  unlock_mutex(tls_mutex);
+  if (path) {
+    // Written to a new file created private from the start, then renamed over the store, so the secrets are never
+    // readable by anyone else, nor the store left half written. On Windows, the file takes its directory's ACL.
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    remove(temporary);
+    #if _WIN32
+      FILE* file = fopen(temporary, "wbx");
+    #else
+      int fd = open(temporary, O_WRONLY | O_CREAT | O_EXCL, 0600);
+      FILE* file = fd != -1 ? fdopen(fd, "wb") : NULL;
+      if (fd != -1 && !file)
+        close(fd);
+    #endif
+    if (file) {
+      int written = fwrite(contents, 1, length, file) == length;
+      if (fclose(file) == 0 && written) {
+        #if _WIN32
+          MoveFileExA(temporary, path, MOVEFILE_REPLACE_EXISTING);
+        #else
+          rename(temporary, path);
+        #endif
+      } else
+        remove(temporary);
+    }
+  }
+  unlock_mutex(tls_store_mutex);
+  free(contents);
+  free(path);
+}
+
+// Must hold the tls mutex.
+static void tls_load_sessions() {
+  FILE* file = fopen(tls_session_store, "rb");
+  if (!file)
+    return;
+  unsigned char header[4], buffer[4096];
+  char key[512];
+  while (fread(header, 1, 2, file) == 2) {
+    size_t key_length = (header[0] << 8) | header[1];
+    if (key_length >= sizeof(key) || fread(key, 1, key_length, file) != key_length || fread(header, 1, 4, file) != 4)
+      break;
+    key[key_length] = 0;
+    size_t length = ((size_t)header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+    if (length > sizeof(buffer) || fread(buffer, 1, length, file) != length)
+      break;
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    if (mbedtls_ssl_session_load(&session, buffer, length) == 0)
+      tls_store_session(key, &session);
+    else
+      mbedtls_ssl_session_free(&session);
+  }
+  fclose(file);
+}
+
+static int tls_bio_send(void* data, const unsigned char* buffer, size_t length) {
+  tls_stream_t* stream = data;
+  if (!stream->inner)
+    return mbedtls_net_send(&stream->net, buffer, length);
+  ssize_t written = stream->inner->write(stream->inner, (const char*)buffer, length, 0);
+  return written < 0 ? MBEDTLS_ERR_NET_SEND_FAILED : (int)written;
+}
+
+static int tls_bio_recv(void* data, unsigned char* buffer, size_t length) {
+  tls_stream_t* stream = data;
+  if (!stream->inner)
+    return mbedtls_net_recv(&stream->net, buffer, length);
+  ssize_t read = stream->inner->read(stream->inner, buffer, length);
+  return read < 0 ? MBEDTLS_ERR_NET_RECV_FAILED : (int)read;
+}
+
+static int tls_stream_connect(git_stream* parent) {
+  tls_stream_t* stream = (tls_stream_t*)parent;
+  int error;
+  if (!stream->inner && (error = mbedtls_net_connect(&stream->net, stream->host, stream->port, MBEDTLS_NET_PROTO_TCP)))
+    return tls_error(error, "connect");
+  stream->trust = tls_acquire_trust();
+  if ((error = mbedtls_ssl_setup(&stream->ssl, &stream->trust->config)) || (error = mbedtls_ssl_set_hostname(&stream->ssl, stream->host)))
+    return tls_error(error, "setup");
+  mbedtls_ssl_set_bio(&stream->ssl, stream, tls_bio_send, tls_bio_recv, NULL);
+  lock_mutex(tls_mutex);
+  tls_session_t* entry = tls_find_session(stream->key);
+  if (entry)
+    mbedtls_ssl_set_session(&stream->ssl, &entry->session);
+  unlock_mutex(tls_mutex);
+  while ((error = mbedtls_ssl_handshake(&stream->ssl))) {
+    if (error != MBEDTLS_ERR_SSL_WANT_READ && error != MBEDTLS_ERR_SSL_WANT_WRITE)
+      return tls_error(error, "handshake");
+  }
+  // Verification is checked here rather than failing the handshake, so that libgit2's certificate_check callback still
+  // gets a say over an invalid certificate; but a session is only kept from a connection that passed it.
+  if (mbedtls_ssl_get_verify_result(&stream->ssl)) {
+    if (!tls_verify)
+      return 0;
+    git_error_set_str(GIT_ERROR_SSL, "the SSL certificate is invalid");
+    return GIT_ECERTIFICATE;
+  }
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  if (mbedtls_ssl_get_session(&stream->ssl, &session) == 0) {
+    lock_mutex(tls_mutex);
+    int changed = tls_store_session(stream->key, &session);
+    unlock_mutex(tls_mutex);
+    if (changed)
+      tls_save_sessions();
+  } else
+    mbedtls_ssl_session_free(&session);
+  return 0;
+}
+
+static int tls_stream_certificate(git_cert** out, git_stream* parent) {
+  tls_stream_t* stream = (tls_stream_t*)parent;
+  const mbedtls_x509_crt* peer = mbedtls_ssl_get_peer_cert(&stream->ssl);
+  if (!peer) {
+    git_error_set_str(GIT_ERROR_SSL, "the server did not provide a certificate");
+    return -1;
+  }
+  stream->cert.parent.cert_type = GIT_CERT_X509;
+  stream->cert.data = peer->raw.p;
+  stream->cert.len = peer->raw.len;
+  *out = &stream->cert.parent;
+  return 0;
+}
+
+static ssize_t tls_stream_read(git_stream* parent, void* data, size_t length) {
+  tls_stream_t* stream = (tls_stream_t*)parent;
+  int read;
+  while ((read = mbedtls_ssl_read(&stream->ssl, data, length)) == MBEDTLS_ERR_SSL_WANT_READ || read == MBEDTLS_ERR_SSL_WANT_WRITE);
+  if (read == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+    return 0;
+  return read < 0 ? tls_error(read, "read") : read;
+}
+
+static ssize_t tls_stream_write(git_stream* parent, const char* data, size_t length, int flags) {
+  tls_stream_t* stream = (tls_stream_t*)parent;
+  size_t total = 0;
+  while (total < length) {
+    int written = mbedtls_ssl_write(&stream->ssl, (const unsigned char*)data + total, length - total);
+    if (written == MBEDTLS_ERR_SSL_WANT_READ || written == MBEDTLS_ERR_SSL_WANT_WRITE)
+      continue;
+    if (written < 0)
+      return tls_error(written, "write");
+    total += written;
+  }
+  return total;
+}
+
+static int tls_stream_close(git_stream* parent) {
+  tls_stream_t* stream = (tls_stream_t*)parent;
+  mbedtls_ssl_close_notify(&stream->ssl);
+  if (!stream->inner)
+    mbedtls_net_free(&stream->net);
+  return 0;
+}
+
+static void tls_stream_free(git_stream* parent) {
+  tls_stream_t* stream = (tls_stream_t*)parent;
+  mbedtls_ssl_free(&stream->ssl);
+  mbedtls_net_free(&stream->net);
+  if (stream->trust)
+    tls_release_trust(stream->trust);
+  free(stream->host);
+  free(stream->port);
+  free(stream);
+}
+
+static tls_stream_t* tls_stream_new(const char* host, const char* port) {
+  tls_stream_t* stream = calloc(1, sizeof(tls_stream_t));
+  mbedtls_net_init(&stream->net);
+  mbedtls_ssl_init(&stream->ssl);
+  stream->host = strdup(host);
+  stream->port = port ? strdup(port) : NULL;
+  if (port)
+    snprintf(stream->key, sizeof(stream->key), "%s:%s", host, port);
+  else
+    snprintf(stream->key, sizeof(stream->key), "%s", host);
+  stream->parent.version = GIT_STREAM_VERSION;
+  stream->parent.encrypted = 1;
+  stream->parent.connect = tls_stream_connect;
+  stream->parent.certificate = tls_stream_certificate;
+  stream->parent.read = tls_stream_read;
+  stream->parent.write = tls_stream_write;
+  stream->parent.close = tls_stream_close;
+  stream->parent.free = tls_stream_free;
+  return stream;
+}
+
+static int tls_stream_init(git_stream** out, const char* host, const char* port) {
+  *out = &tls_stream_new(host, port)->parent;
+  return 0;
+}
+
+// Wrapped streams, such as those through a proxy, are already connected, and libgit2 only passes on the host; their
+// sessions are kept by host alone.
+static int tls_stream_wrap(git_stream** out, git_stream* in, const char* host) {
+  tls_stream_t* stream = tls_stream_new(host, NULL);
+  stream->inner = in;
+  *out = &stream->parent;
+  return 0;
+}
+
+static void init_tls() {
+  tls_mutex = create_mutex();
+  tls_store_mutex = create_mutex();
+  mbedtls_entropy_init(&entropy_context);
+  mbedtls_ctr_drbg_init(&drbg_context);
+  mbedtls_ctr_drbg_seed(&drbg_context, mbedtls_entropy_func, &entropy_context, NULL, 0);
+  tls_trust = tls_trust_new(NULL, 0);
+  git_stream_registration registration = { GIT_STREAM_VERSION, tls_stream_init, tls_stream_wrap };
+  git_stream_register(GIT_STREAM_TLS, &registration);
+}
+
+static void close_tls() {
+  git_stream_register(GIT_STREAM_TLS, NULL);
+  while (tls_sessions) {
+    tls_session_t* entry = tls_sessions;
+    tls_sessions = entry->next;
+    mbedtls_ssl_session_free(&entry->session);
+    free(entry->key);
+    free(entry);
+  }
+  free(tls_session_store);
+  tls_session_store = NULL;
+  tls_set_trust(NULL);
+  mbedtls_ctr_drbg_free(&drbg_context);
+  mbedtls_entropy_free(&entropy_context);
+  close_mutex(tls_store_mutex);
+  close_mutex(tls_mutex);
+}
+
+// Sets the file sessions are kept in, loading any it already holds.
+static void tls_set_session_store(const char* path) {
+  lock_mutex(tls_mutex);
+  free(tls_session_store);
+  tls_session_store = strdup(path);
+  tls_load_sessions();
+  unlock_mutex(tls_mutex);
+}
+
 static int f_git_gc(lua_State* L) {
+  close_pool();
+  close_tls();
   git_libgit2_shutdown();
   return 0;
 }
 
-static int has_setup_ssl = 0;
+static struct { const char* name; git_object_t type; } cache_object_types[] = {
+  { "commit", GIT_OBJECT_COMMIT },
+  { "tree",   GIT_OBJECT_TREE },
+  { "blob",   GIT_OBJECT_BLOB },
+  { "tag",    GIT_OBJECT_TAG },
+  { NULL, 0 }
+};
+
+// Each option is applied as it's read, so one that fails raises an error naming it, with those before it already set.
+static void options_check(lua_State* L, int error, const char* option) {
+  if (error)
+    luaL_error(L, "git options error: %s: %s", option, git_error_last_string());
+}
+
+// Sets whichever of the following are present in the table: cache_max_size (bytes), cache_limits (a table of commit,
+// tree, blob and tag object size limits), caching, mwindow_size, mwindow_mapped_limit, mwindow_file_limit,
+// strict_object_creation, strict_hash_verification, threads (the size of the worker pool), helper_threads (the most
+// extra threads checkouts and searches may start between them), checkout_workers, search_workers, remote_idle_timeout
+// (seconds) and tls_session_store (a file to keep TLS sessions in between runs).
+// Returns a table of the current values, along with cached_memory, the bytes currently held by the object cache.
+static int f_git_options(lua_State* L) {
+  lua_Integer value;
+  if (lua_istable(L, 1)) {
+    if (lua_getoptinteger(L, 1, "cache_max_size", &value))
+      options_check(L, git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, (ssize_t)value), "cache_max_size");
+    if (lua_getfield(L, 1, "cache_limits") == LUA_TTABLE) {
+      for (int i = 0; cache_object_types[i].name; ++i) {
+        if (lua_getoptinteger(L, -1, cache_object_types[i].name, &value))
+          options_check(L, git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, cache_object_types[i].type, (size_t)value), cache_object_types[i].name);
+      }
+    }
+    lua_pop(L, 1);
+    if (lua_getfield(L, 1, "caching") != LUA_TNIL)
+      options_check(L, git_libgit2_opts(GIT_OPT_ENABLE_CACHING, lua_toboolean(L, -1)), "caching");
+    lua_pop(L, 1);
+    if (lua_getoptinteger(L, 1, "mwindow_size", &value))
+      options_check(L, git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, (size_t)value), "mwindow_size");
+    if (lua_getoptinteger(L, 1, "mwindow_mapped_limit", &value))
+      options_check(L, git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, (size_t)value), "mwindow_mapped_limit");
+    if (lua_getoptinteger(L, 1, "mwindow_file_limit", &value))
+      options_check(L, git_libgit2_opts(GIT_OPT_SET_MWINDOW_FILE_LIMIT, (size_t)value), "mwindow_file_limit");
+    if (lua_getfield(L, 1, "strict_object_creation") != LUA_TNIL)
+      options_check(L, git_libgit2_opts(GIT_OPT_ENABLE_STRICT_OBJECT_CREATION, lua_toboolean(L, -1)), "strict_object_creation");
+    lua_pop(L, 1);
+    if (lua_getfield(L, 1, "strict_hash_verification") != LUA_TNIL)
+      options_check(L, git_libgit2_opts(GIT_OPT_ENABLE_STRICT_HASH_VERIFICATION, lua_toboolean(L, -1)), "strict_hash_verification");
+    lua_pop(L, 1);
+    if (lua_getoptinteger(L, 1, "threads", &value)) {
+      if (value < 1)
+        return luaL_error(L, "threads must be positive");
+      // Threads already running stay up until the pool is closed; lowering the limit just stops more being started.
+      lock_mutex(pool.mutex);
+      pool.threads = realloc(pool.threads, sizeof(thread_t*) * (value > pool.thread_count ? value : pool.thread_count));
+      pool.max_threads = value;
+      unlock_mutex(pool.mutex);
+    }
+    if (lua_getoptinteger(L, 1, "helper_threads", &value)) {
+      if (value < 0)
+        return luaL_error(L, "helper_threads can't be negative");
+      lock_mutex(pool.mutex);
+      pool.max_helpers = value;
+      unlock_mutex(pool.mutex);
+    }
+    if (lua_getfield(L, 1, "tls_session_store") != LUA_TNIL)
+      tls_set_session_store(luaL_checkstring(L, -1));
+    lua_pop(L, 1);
+    if (lua_getfield(L, 1, "remote_idle_timeout") != LUA_TNIL) {
+      double timeout = luaL_checknumber(L, -1);
+      lock_mutex(pool.mutex);
+      remote_idle_timeout = timeout;
+      // Expiries are recalculated by the next sweep, which is brought forward to now.
+      if (pool.next_sweep) {
+        pool.next_sweep = get_time();
+        signal_cond(pool.queued);
+      }
+      unlock_mutex(pool.mutex);
+    }
+    lua_pop(L, 1);
+    if (lua_getoptinteger(L, 1, "checkout_workers", &value)) {
+      if (value < 1)
+        return luaL_error(L, "checkout_workers must be positive");
+      checkout_workers = value;
+    }
+    if (lua_getoptinteger(L, 1, "search_workers", &value)) {
+      if (value < 1)
+        return luaL_error(L, "search_workers must be positive");
+      search_workers = value;
+    }
+  }
+  ssize_t cached_memory, cache_max_size;
+  size_t mwindow_size, mwindow_mapped_limit, mwindow_file_limit;
+  git_libgit2_opts(GIT_OPT_GET_CACHED_MEMORY, &cached_memory, &cache_max_size);
+  git_libgit2_opts(GIT_OPT_GET_MWINDOW_SIZE, &mwindow_size);
+  git_libgit2_opts(GIT_OPT_GET_MWINDOW_MAPPED_LIMIT, &mwindow_mapped_limit);
+  git_libgit2_opts(GIT_OPT_GET_MWINDOW_FILE_LIMIT, &mwindow_file_limit);
+  lua_newtable(L);
+  lua_pushinteger(L, cached_memory); lua_setfield(L, -2, "cached_memory");
+  lua_pushinteger(L, cache_max_size); lua_setfield(L, -2, "cache_max_size");
+  lua_pushinteger(L, mwindow_size); lua_setfield(L, -2, "mwindow_size");
+  lua_pushinteger(L, mwindow_mapped_limit); lua_setfield(L, -2, "mwindow_mapped_limit");
+  lua_pushinteger(L, mwindow_file_limit); lua_setfield(L, -2, "mwindow_file_limit");
+  lock_mutex(pool.mutex);
+  int threads = pool.max_threads, helper_threads = pool.max_helpers;
+  unlock_mutex(pool.mutex);
+  lua_pushinteger(L, threads); lua_setfield(L, -2, "threads");
+  lua_pushinteger(L, helper_threads); lua_setfield(L, -2, "helper_threads");
+  lua_pushinteger(L, checkout_workers); lua_setfield(L, -2, "checkout_workers");
+  lua_pushinteger(L, search_workers); lua_setfield(L, -2, "search_workers");
+  lua_pushnumber(L, remote_idle_timeout); lua_setfield(L, -2, "remote_idle_timeout");
+  return 1;
+}
 
 static int f_git_certs(lua_State* L) {
   const char* type = luaL_checkstring(L, 1);
-  has_setup_ssl = 1;
   if (strcmp(type, "noverify") == 0) {
-    mbedtls_ssl_conf_authmode(&ssl_config, MBEDTLS_SSL_VERIFY_OPTIONAL);
+    tls_verify = 0;
   } else {
     const char* path = luaL_checkstring(L, 2);
     if (strcmp(type, "dir") == 0) {
-      git_libgit2_opts(GIT_OPT_SET_SSL_CERT_LOCATIONS, NULL, path);
+      tls_trust_t* trust = tls_trust_new(path, 1);
+      if (!trust)
+        return luaL_error(L, "can't parse certificates in %s", path);
+      tls_set_trust(trust);
     } else {
       if (strcmp(type, "system") == 0) {
         #if _WIN32
@@ -574,12 +5073,63 @@ static int f_git_certs(lua_State* L) {
           return luaL_error(L, "can't use system certificates except on windows or mac");
         #endif
       }
-      git_libgit2_opts(GIT_OPT_SET_SSL_CERT_LOCATIONS, path, NULL);
+      tls_trust_t* trust = tls_trust_new(path, 0);
+      if (!trust)
+        return luaL_error(L, "can't parse certificates in %s", path);
+      tls_set_trust(trust);
     }
   }
   return 0;
 }
 
+// Converts a raw string, or a table of them, to hex.
+static int f_git_hex(lua_State* L) {
+  luaL_Buffer buffer;
+  size_t length;
+  if (lua_istable(L, 1)) {
+    size_t count = lua_rawlen(L, 1);
+    lua_createtable(L, count, 0);
+    for (size_t i = 1; i <= count; ++i) {
+      lua_rawgeti(L, 1, i);
+      const char* raw = luaL_checklstring(L, -1, &length);
+      hex_encode(luaL_buffinitsize(L, &buffer, length*2), (const unsigned char*)raw, length);
+      luaL_pushresultsize(&buffer, length*2);
+      lua_rawseti(L, -3, i);
+      lua_pop(L, 1);
+    }
+    return 1;
+  }
+  const char* raw = luaL_checklstring(L, 1, &length);
+  hex_encode(luaL_buffinitsize(L, &buffer, length*2), (const unsigned char*)raw, length);
+  luaL_pushresultsize(&buffer, length*2);
+  return 1;
+}
+
+// Converts a hex string, or a table of them, to raw.
+static int f_git_unhex(lua_State* L) {
+  luaL_Buffer buffer;
+  size_t length;
+  if (lua_istable(L, 1)) {
+    size_t count = lua_rawlen(L, 1);
+    lua_createtable(L, count, 0);
+    for (size_t i = 1; i <= count; ++i) {
+      lua_rawgeti(L, 1, i);
+      const char* hex = luaL_checklstring(L, -1, &length);
+      if (length % 2 || hex_decode((unsigned char*)luaL_buffinitsize(L, &buffer, length/2), hex, length/2))
+        return luaL_error(L, "invalid hex string at index %d", (int)i);
+      luaL_pushresultsize(&buffer, length/2);
+      lua_rawseti(L, -3, i);
+      lua_pop(L, 1);
+    }
+    return 1;
+  }
+  const char* hex = luaL_checklstring(L, 1, &length);
+  if (length % 2 || hex_decode((unsigned char*)luaL_buffinitsize(L, &buffer, length/2), hex, length/2))
+    return luaL_error(L, "invalid hex string");
+  luaL_pushresultsize(&buffer, length/2);
+  return 1;
+}
+
 static void f_git_trace_callback(git_trace_level_t level, const char* msg) {
   fprintf(stderr, "%s\n", msg);
 }
@@ -600,6 +5150,7 @@ luaL_Reg remote_metatable[] = {
   { "__gc",       f_git_remote_gc },
   { "push",       f_git_remote_push },
   { "fetch",      f_git_remote_fetch },
+  { "ls",         f_git_remote_ls },
   { NULL, NULL }
 };
 
@@ -612,14 +5163,63 @@ static luaL_Reg repo_metatable[] = {
   { "reset",      f_git_repo_reset },
   { "merge",      f_git_repo_merge },
   { "lookup",     f_git_repo_lookup },
+  { "status",     f_git_repo_status },
+  { "log",        f_git_repo_log },
+  { "commit_graph", f_git_repo_commit_graph },
+  { "ahead_behind_all", f_git_repo_ahead_behind_all },
+  { "diff_buffer", f_git_repo_diff_buffer },
+  { "diff",       f_git_repo_diff },
+  { "blame",      f_git_repo_blame },
+  { "search_history", f_git_repo_search_history },
+  { NULL, NULL }
+};
+
+static luaL_Reg log_metatable[] = {
+  { "__gc",       f_git_log_gc },
+  { "__call",     f_git_log_next },
+  { "next",       f_git_log_next },
   { NULL, NULL }
 };
 
+static luaL_Reg diff_metatable[] = {
+  { "__gc",       f_git_diff_gc },
+  { "__call",     f_git_diff_next },
+  { "next",       f_git_diff_next },
+  { NULL, NULL }
+};
+
+static luaL_Reg search_metatable[] = {
+  { "__gc",       f_git_search_gc },
+  { "__call",     f_git_search_next },
+  { "next",       f_git_search_next },
+  { NULL, NULL }
+};
+
+static struct { const char* name; unsigned int flag; } status_flags[] = {
+  { "INDEX_NEW",        GIT_STATUS_INDEX_NEW },
+  { "INDEX_MODIFIED",   GIT_STATUS_INDEX_MODIFIED },
+  { "INDEX_DELETED",    GIT_STATUS_INDEX_DELETED },
+  { "INDEX_RENAMED",    GIT_STATUS_INDEX_RENAMED },
+  { "INDEX_TYPECHANGE", GIT_STATUS_INDEX_TYPECHANGE },
+  { "WT_NEW",           GIT_STATUS_WT_NEW },
+  { "WT_MODIFIED",      GIT_STATUS_WT_MODIFIED },
+  { "WT_DELETED",       GIT_STATUS_WT_DELETED },
+  { "WT_TYPECHANGE",    GIT_STATUS_WT_TYPECHANGE },
+  { "WT_RENAMED",       GIT_STATUS_WT_RENAMED },
+  { "IGNORED",          GIT_STATUS_IGNORED },
+  { "CONFLICTED",       GIT_STATUS_CONFLICTED },
+  { NULL, 0 }
+};
+
 static luaL_Reg plugin_api[] = {
   { "__gc",       f_git_gc },
   { "open",       f_git_open },
+  { "clone",      f_git_clone },
   { "certs",      f_git_certs },
   { "trace",      f_git_trace },
+  { "options",    f_git_options },
+  { "hex",        f_git_hex },
+  { "unhex",      f_git_unhex },
   { NULL, NULL }
 };
 
@@ -630,6 +5230,9 @@ int luaopen_lite_xl_libgit2(lua_State* L, void* XL) {
 int luaopen_libgit2(lua_State* L) {
 #endif
   git_libgit2_init();
+  init_pool();
+  init_hex_tables();
+  init_tls();
   #if defined(MBEDTLS_DEBUG_C)
     // git_trace_set(GIT_TRACE_TRACE, lpm_libgit2_debug);
   #endif
@@ -641,7 +5244,28 @@ int luaopen_libgit2(lua_State* L) {
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "__index");
   luaL_setfuncs(L, remote_metatable, 0);
+  luaL_newmetatable(L, API_GIT_LOG);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, log_metatable, 0);
+  luaL_newmetatable(L, API_GIT_DIFF);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, diff_metatable, 0);
+  luaL_newmetatable(L, API_GIT_SEARCH);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, search_metatable, 0);
+  luaL_newmetatable(L, API_GIT_CLONE);
+  lua_pushcfunction(L, f_git_clone_gc);
+  lua_setfield(L, -2, "__gc");
   luaL_newlib(L, plugin_api);
+  lua_newtable(L);
+  for (int i = 0; status_flags[i].name; ++i) {
+    lua_pushinteger(L, status_flags[i].flag);
+    lua_setfield(L, -2, status_flags[i].name);
+  }
+  lua_setfield(L, -2, "STATUS");
   lua_pushvalue(L, -1);
   lua_setmetatable(L, -2);
   return 1;